@@ -45,6 +45,8 @@ else
 fi
 
 is_release=false
+is_lib=false
+is_check=false
 serve=true
 
 for x in $@; do
@@ -72,18 +74,61 @@ for x in $@; do
       units="$units main.c"
       ;;
 
+    # just the calculator as libcubecalc.a and libcubecalc.so, no ui and no glfw/gl.
+    # see the top of cubecalc.c for the api
+    lib*)
+      units=compilation-units/cubecalc_impl.c
+      is_lib=true
+      serve=false
+      ;;
+
+    # build and run the calculator checks in check.c, no ui
+    check*)
+      units=check.c
+      is_check=true
+      serve=false
+      ;;
+
     *)
       cc="$x"
       ;;
   esac
 done
 
+# checks are timed and print a lot with the debug flags and the library is meant to be linked
+# into other programs, so both default to release. no lto so libcubecalc.a links without it
+if ($is_check || $is_lib) && [ "$buildflags" = "-O0" ]; then
+  buildflags="-O3"
+  dbgflags=""
+fi
+
 compiler="$("$cc" --version 2>&1 | cut -d' ' -f1 | sed 1q)"
 is_emcc=false
 if [ "$compiler" = "emcc" ]; then
   is_emcc=true
 fi
-if ! $is_emcc; then
+if $is_lib; then
+  if $is_emcc; then
+    echo "lib can't be built with emcc"
+    exit 1
+  fi
+  preflags="$preflags -fPIC"
+  platformflags="
+    -D_GNU_SOURCE
+    -pthread
+  "
+elif $is_check; then
+  if $is_emcc; then
+    echo "check can't be built with emcc"
+    exit 1
+  fi
+  platformflags="
+    -ocubecalc-check
+    -lm
+    -D_GNU_SOURCE
+    -pthread
+  "
+elif ! $is_emcc; then
   preflags="
     $preflags
     $(pkg-config --cflags --libs-only-L glfw3 gl)
@@ -108,7 +153,15 @@ if which mold >/dev/null 2>&1; then
   moldcmd="mold -run"
 fi
 
-if $is_emcc; then
+if $is_lib; then
+  time $moldcmd $cc -c -o libcubecalc.o $flags || exit
+  ar rcs libcubecalc.a libcubecalc.o || exit
+  rm -f libcubecalc.o
+  time $moldcmd $cc -shared -o libcubecalc.so $flags -lm || exit
+elif $is_check; then
+  time $moldcmd $cc $flags || exit
+  ./cubecalc-check
+elif $is_emcc; then
   # note: these commands cannot run concurrently if the cache doesn't already exists or needs to
   #       be updated. seems to be a limitation of emcc
   $moldcmd $cc -o main.js $flags $mtflags $wasmflags
@@ -0,0 +1,619 @@
+// checks for the calculator that don't need the ui. build and run them with ./build.sh check
+// exits with a non-zero status if anything fails
+
+#define CUBECALC_MONOLITH
+#include "cubecalc.c"
+
+static int failures;
+
+typedef struct _CheckItem {
+  Category category;
+  Cube cube;
+  Tier tier;
+  int lvl;
+  Region region;
+} CheckItem;
+
+static CheckItem const checkItems[] = {
+  { WEAPON, VIOLET, LEGENDARY, 200, GMS },
+  { WEAPON, RED, LEGENDARY, 200, GMS },
+  { WEAPON, OCCULT, EPIC, 150, GMS },
+};
+
+static
+int checkClose(float a, float b) {
+  return fabsf(a - b) <= 1e-5f * Max(fabsf(a), fabsf(b)) + 1e-9f;
+}
+
+// two thresholds under an operator, the wants the engines are checked against CubeCalc with
+typedef struct _CheckWant {
+  Want a, b;
+  int op;
+} CheckWant;
+
+static CheckWant const checkWants[] = {
+  { WantStat(ATT, 21), WantStat(BOSS, 30), WANT_AND },
+  { WantStat(ATT, 30), WantStat(IED, 30), WANT_OR },
+  { WantStat(BOSS, 70), WantStat(IED, 0), WANT_AND },
+  { WantStat(ATT, 33), WantStat(BOSS, 40), WANT_OR },
+};
+
+static
+void checkWantBuf(Want** pwant, CheckWant const* w) {
+  BufClear(*pwant);
+  *BufAlloc(pwant) = w->a;
+  *BufAlloc(pwant) = w->b;
+  *BufAlloc(pwant) = (Want){ .type = WANT_OP, .op = w->op, .opCount = 2 };
+}
+
+// WantOptimize must not change the result: zero thresholds, thresholds the item can't reach and
+// the stats they mention, under both AND and OR
+static
+void checkOptimize(CubeContext* ctx) {
+  static Want const stats[] = { WantStat(ATT, 0), WantStat(BOSS, 0), WantStat(IED, 0) };
+  static int const values[] = { 0, 9, 999 };
+  static int const ops[] = { WANT_AND, WANT_OR };
+  Want* want = 0;
+  Want* optimized = 0;
+  size_t n = 0;
+
+  ArrayEach(CheckItem const, checkItems, it) {
+    RangeBefore(ArrayLength(stats), a) {
+      RangeFromBefore(a + 1, ArrayLength(stats), b) {
+        ArrayEach(int const, values, va) {
+          ArrayEach(int const, values, vb) {
+            ArrayEach(int const, ops, op) {
+              BufClear(want);
+              *BufAlloc(&want) = stats[a];
+              BufAt(want, -1).value = *va;
+              *BufAlloc(&want) = stats[b];
+              BufAt(want, -1).value = *vb;
+              *BufAlloc(&want) = (Want){ .type = WANT_OP, .op = *op, .opCount = 2 };
+              if (!WantOptimize(ctx, want, it->category, it->cube, it->tier, it->lvl,
+                    it->region, &optimized))
+              {
+                fprintf(stderr, "WantOptimize failed\n");
+                ++failures;
+                continue;
+              }
+              float raw = CubeCalc(ctx, want, it->category, it->cube, it->tier, it->lvl,
+                it->region, 0);
+              float opt = BufLen(optimized)
+                ? CubeCalc(ctx, optimized, it->category, it->cube, it->tier, it->lvl,
+                    it->region, 0)
+                : 0;
+              if (!checkClose(raw, opt)) {
+                fprintf(stderr, "cube 0x%x: %s of %d and %d: %.9g raw, %.9g optimized\n",
+                  it->cube, WantOpNames[*op], *va, *vb, raw, opt);
+                ++failures;
+              }
+              ++n;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  printf("optimize: %zu wants\n", n);
+  BufFree(&want);
+  BufFree(&optimized);
+}
+
+// the most slots of the cache index a lookup may look at on average. lookups stop at the first
+// empty slot and the index is at most half full, so this is only exceeded if the cost of a miss
+// grows with the number of entries
+#define CHECK_MAX_PROBES 4.0
+
+// cpu seconds to calculate a sweep of distinct wants that all miss the cache. *probes is set to
+// the average slots looked at per lookup for the att amount where it was the highest
+static
+double checkSweep(CubeContext* ctx, size_t budget, double* probes) {
+  Want* want = 0;
+  CubeCacheClear(ctx);
+  CubeCacheConfig(ctx, budget, 1);
+  *probes = 0;
+  clock_t start = clock();
+  Range(1, 20, att) {
+    CubeCacheStats before = CubeCacheGetStats(ctx);
+    Range(1, 20, boss) {
+      Range(1, 20, ied) {
+        BufClear(want);
+        *BufAlloc(&want) = WantStat(ATT, att);
+        *BufAlloc(&want) = WantStat(BOSS, boss);
+        *BufAlloc(&want) = WantStat(IED, ied);
+        *BufAlloc(&want) = WantOp(OR, 3);
+        (void)CubeCalc(ctx, want, WEAPON, RED, LEGENDARY, 200, GMS, 0);
+      }
+    }
+    CubeCacheStats after = CubeCacheGetStats(ctx);
+    size_t lookups = after.hits + after.misses - before.hits - before.misses;
+    if (lookups) {
+      *probes = Max(*probes, (double)(after.probes - before.probes) / lookups);
+    }
+  }
+  double res = (double)(clock() - start) / CLOCKS_PER_SEC;
+  BufFree(&want);
+  return res;
+}
+
+// every miss has to stay cheap no matter how many entries the cache has. that's checked by
+// counting the slots lookups look at, the timings are only printed since they depend on the load
+// of the machine
+static
+void checkCacheSweep(CubeContext* ctx) {
+  double probes;
+  // the first sweep also builds the configuration for the item, don't time that
+  (void)checkSweep(ctx, 0, &probes);
+  double off = checkSweep(ctx, 0, &probes);
+  double on = checkSweep(ctx, CUBE_CACHE_DEFAULT_BUDGET, &probes);
+  CubeCacheStats stats = CubeCacheGetStats(ctx);
+  printf("cache: cold sweep %.3fs with the cache off, %.3fs on (%zu entries, %.2f probes per "
+    "lookup)\n", off, on, stats.entries, probes);
+  if (probes > CHECK_MAX_PROBES) {
+    fprintf(stderr, "cache lookups look at %.2f slots on average as the cache fills up\n",
+      probes);
+    ++failures;
+  }
+  CubeCacheClear(ctx);
+}
+
+// without tier ups a plan is a geometric distribution: 1/p cubes on average with a standard
+// deviation of sqrt(1 - p)/p, or 0 when the want can't be rolled
+static
+void checkPlan(CubeContext* ctx) {
+  Want* want = 0;
+  size_t n = 0;
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEach(CheckWant const, checkWants, w) {
+      checkWantBuf(&want, w);
+      CubePlan plan;
+      float p = CubeCalc(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region, 0);
+      if (!CubeCalcPlan(ctx, want, it->category, it->cube, it->tier, it->tier, it->lvl,
+            it->region, 0, &plan))
+      {
+        fprintf(stderr, "CubeCalcPlan failed\n");
+        ++failures;
+        continue;
+      }
+      float expected = p > 0 ? 1 / p : 0;
+      float stddev = p > 0 ? sqrtf(1 - p) / p : 0;
+      if (!checkClose((float)plan.expected, expected) || !checkClose((float)plan.stddev, stddev)) {
+        fprintf(stderr, "cube 0x%x: plan expects %.9g cubes (stddev %.9g), 1/p is %.9g (%.9g)\n",
+          it->cube, plan.expected, plan.stddev, expected, stddev);
+        ++failures;
+      }
+      ++n;
+    }
+  }
+  printf("plan: %zu wants\n", n);
+  BufFree(&want);
+}
+
+// without tier ups each cube is a strategy of its own that costs its price times 1/p. they must
+// all be there, cheapest first, and k must keep the cheapest
+static
+void checkStrategies(CubeContext* ctx) {
+  CubeStrategyCube cubes[] = {
+    { .cube = RED, .cost = 1 },
+    { .cube = BLACK, .cost = 2 },
+    { .cube = VIOLET, .cost = 3 },
+  };
+  Want* want = 0;
+  size_t n = 0;
+  ArrayEach(CheckWant const, checkWants, w) {
+    checkWantBuf(&want, w);
+    size_t reachable = 0;
+    ArrayEach(CubeStrategyCube const, cubes, c) {
+      reachable += CubeCalc(ctx, want, WEAPON, c->cube, LEGENDARY, 200, GMS, 0) > 0;
+    }
+    RangeBefore(2, k) {
+      CubeStrategy* st = CubeCalcStrategies(ctx, want, WEAPON, 200, GMS, LEGENDARY, LEGENDARY,
+        cubes, ArrayLength(cubes), k);
+      if (!st || BufLen(st) != (k ? Min((size_t)k, reachable) : reachable)) {
+        fprintf(stderr, "strategies k=%zu: %zu strategies, %zu cubes can roll the want\n",
+          (size_t)k, st ? BufLen(st) : 0, reachable);
+        ++failures;
+        BufFree(&st);
+        continue;
+      }
+      BufEachi(st, i) {
+        CubeStrategy const* s = &st[i];
+        double cost = 0;
+        ArrayEach(CubeStrategyCube const, cubes, c) {
+          cost = c->cube == s->roll ? c->cost : cost;
+        }
+        float p = CubeCalc(ctx, want, WEAPON, s->roll, LEGENDARY, 200, GMS, 0);
+        if (s->up != s->roll || !checkClose((float)s->cost, (float)(cost / p)) ||
+            !checkClose((float)s->expected, 1 / p) || (i && s->cost < st[i - 1].cost))
+        {
+          fprintf(stderr, "cube 0x%x: strategy %zu costs %.9g in %.9g cubes, expected %.9g "
+            "in %.9g\n", s->roll, (size_t)i, s->cost, s->expected, cost / p, 1 / p);
+          ++failures;
+        }
+        ++n;
+      }
+      BufFree(&st);
+    }
+  }
+  printf("strategies: %zu strategies\n", n);
+  BufFree(&want);
+}
+
+// tier up chances that stop at unique can't reach a legendary target. that's an empty table, not a
+// failure
+static
+void checkStrategiesUnreachable(CubeContext* ctx) {
+  Want const want[] = { WantStat(ATT, 9), WantOp(AND, 1) };
+  CubeStrategyCube cubes[] = {
+    { .cube = RED, .cost = 1 },
+    { .cube = BLACK, .cost = 2 },
+  };
+  ArrayEach(CubeStrategyCube, cubes, c) {
+    c->tierUp[RARE] = 0.05;
+    c->tierUp[EPIC] = 0.02;
+  }
+  Want* wantBuf = 0;
+  ArrayEach(Want const, want, w) {
+    *BufAlloc(&wantBuf) = *w;
+  }
+  RangeBefore(3, k) {
+    CubeStrategy* st = CubeCalcStrategies(ctx, wantBuf, WEAPON, 200, GMS, RARE, LEGENDARY, cubes,
+      ArrayLength(cubes), k);
+    if (!st || BufLen(st)) {
+      fprintf(stderr, "strategies k=%zu: expected an empty table, got %s\n", (size_t)k,
+        st ? "strategies" : "NULL");
+      ++failures;
+    }
+    BufFree(&st);
+  }
+  BufFree(&wantBuf);
+  printf("strategies: unreachable target\n");
+}
+
+// the simulator must converge to CubeCalc. the rng is seeded, so the estimates are the same on
+// every run and a fixed margin can't flake
+#define CHECK_SIM_ROLLS (1 << 18)
+
+static
+void checkSim(CubeContext* ctx) {
+  Want* want = 0;
+  size_t n = 0;
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEach(CheckWant const, checkWants, w) {
+      checkWantBuf(&want, w);
+      RangeBefore(2, importance) {
+        CubeSimResult sim;
+        if (!CubeSim(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region,
+              CHECK_SIM_ROLLS, 1, importance, &sim))
+        {
+          fprintf(stderr, "CubeSim failed\n");
+          ++failures;
+          continue;
+        }
+        // twice the 95% interval on both sides
+        double margin = sim.hi - sim.lo;
+        if (sim.exact < sim.lo - margin || sim.exact > sim.hi + margin) {
+          fprintf(stderr, "cube 0x%x: simulated %.9g [%.9g, %.9g], CubeCalc %.9g\n", it->cube,
+            sim.p, sim.lo, sim.hi, sim.exact);
+          ++failures;
+        }
+        ++n;
+      }
+    }
+  }
+  printf("sim: %zu estimates\n", n);
+  BufFree(&want);
+}
+
+// probability of the i-th combo, the product of the probabilities of its elements
+static
+float checkComboProb(Combos const* c, size_t i) {
+  float res = 1;
+  RangeBefore(c->comboSize, j) {
+    res *= CombosProb(c, i * c->comboSize + j);
+  }
+  return res;
+}
+
+static
+int checkProbCmp(void const* a, void const* b) {
+  float x = *(float const*)a;
+  float y = *(float const*)b;
+  return (x < y) - (x > y);
+}
+
+// the top k combos must be the k most likely of the full list CubeCalc returns, in order, and
+// the total must be the length of that list
+#define CHECK_TOP_K 10
+
+static
+void checkTop(CubeContext* ctx) {
+  Want* want = 0;
+  float* probs = 0;
+  size_t n = 0;
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEach(CheckWant const, checkWants, w) {
+      checkWantBuf(&want, w);
+      Combos all = {0};
+      Combos top = {0};
+      size_t numCombos = 0;
+      (void)CubeCalc(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region, &all);
+      if (!CubeCalcTop(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region,
+            CHECK_TOP_K, &top, &numCombos))
+      {
+        fprintf(stderr, "CubeCalcTop failed\n");
+        ++failures;
+        goto next;
+      }
+      size_t numAll = CombosNum(&all);
+      BufClear(probs);
+      RangeBefore(numAll, i) {
+        *BufAlloc(&probs) = checkComboProb(&all, i);
+      }
+      if (probs) {
+        qsort(probs, numAll, sizeof(probs[0]), checkProbCmp);
+      }
+      if (numCombos != numAll || CombosNum(&top) != Min(numAll, CHECK_TOP_K)) {
+        fprintf(stderr, "cube 0x%x: top has %zu of %zu combos, CubeCalc has %zu\n", it->cube,
+          CombosNum(&top), numCombos, numAll);
+        ++failures;
+        goto next;
+      }
+      RangeBefore(CombosNum(&top), i) {
+        float p = checkComboProb(&top, i);
+        if (!checkClose(p, probs[i])) {
+          fprintf(stderr, "cube 0x%x: top combo %zu has probability %.9g, expected %.9g\n",
+            it->cube, (size_t)i, p, probs[i]);
+          ++failures;
+          break;
+        }
+      }
+      ++n;
+next:
+      CombosFree(&all);
+      CombosFree(&top);
+    }
+  }
+  printf("top: %zu wants\n", n);
+  BufFree(&want);
+  BufFree(&probs);
+}
+
+// every group must be stored when k is big enough. the groups add up to CubeCalc's result and
+// their orderings to the number of combos it lists
+static
+void checkGrouped(CubeContext* ctx) {
+  Want* want = 0;
+  size_t n = 0;
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEach(CheckWant const, checkWants, w) {
+      checkWantBuf(&want, w);
+      Combos all = {0};
+      Combos groups = {0};
+      size_t numGroups = 0;
+      float p = CubeCalc(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region, &all);
+      if (!CubeCalcGrouped(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region,
+            SIZE_MAX, &groups, &numGroups))
+      {
+        fprintf(stderr, "CubeCalcGrouped failed\n");
+        ++failures;
+      } else {
+        double sum = 0;
+        size_t perms = 0;
+        BufEachi(groups.groupProb, i) {
+          sum += groups.groupProb[i];
+          perms += groups.groupPerms[i];
+        }
+        if (numGroups != BufLen(groups.groupProb) || perms != CombosNum(&all) ||
+            !checkClose((float)sum, p))
+        {
+          fprintf(stderr, "cube 0x%x: %zu of %zu groups add up to %.9g and %zu combos, "
+            "CubeCalc has %.9g and %zu combos\n", it->cube, BufLen(groups.groupProb), numGroups,
+            sum, perms, p, CombosNum(&all));
+          ++failures;
+        }
+        ++n;
+      }
+      CombosFree(&all);
+      CombosFree(&groups);
+    }
+  }
+  printf("grouped: %zu wants\n", n);
+  BufFree(&want);
+}
+
+// a budget small enough that every task takes several steps
+#define CHECK_STEP_NS 1000
+
+// run a task with CHECK_STEP_NS at a time. returns what CubeCalcTaskFree returns, *psteps is
+// incremented by the number of steps
+static
+int checkSteps(CubeCalcTask* t, size_t* psteps) {
+  do {
+    ++*psteps;
+  } while (!CubeCalcStep(t, CHECK_STEP_NS));
+  return CubeCalcTaskFree(t);
+}
+
+// a batch ran in small steps must give the same results as CubeCalc. the cache and the
+// histograms are off so every want is actually walked
+static
+void checkStep(CubeContext* ctx) {
+  Want* wants[ArrayLength(checkWants)] = {0};
+  float expected[ArrayLength(checkWants)];
+  float results[ArrayLength(checkWants)];
+  size_t steps = 0;
+  CubeCacheClear(ctx);
+  CubeCacheConfig(ctx, 0, 1);
+  CubeHistConfig(ctx, 0);
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEachi(checkWants, i) {
+      checkWantBuf(&wants[i], &checkWants[i]);
+      expected[i] = CubeCalc(ctx, wants[i], it->category, it->cube, it->tier, it->lvl,
+        it->region, 0);
+    }
+    CubeCalcTask* t = CubeCalcStart(ctx, (Want const* const*)wants, ArrayLength(wants),
+      it->category, it->cube, it->tier, it->lvl, it->region, results, 0);
+    if (!checkSteps(t, &steps)) {
+      fprintf(stderr, "stepped CubeCalcBatch failed\n");
+      ++failures;
+      continue;
+    }
+    ArrayEachi(checkWants, i) {
+      if (!checkClose(results[i], expected[i])) {
+        fprintf(stderr, "cube 0x%x: stepped %.9g, CubeCalc %.9g\n", it->cube, results[i],
+          expected[i]);
+        ++failures;
+      }
+    }
+  }
+  if (steps <= ArrayLength(checkItems)) {
+    fprintf(stderr, "every batch ran in a single step\n");
+    ++failures;
+  }
+  printf("step: %zu steps\n", steps);
+  CubeCacheConfig(ctx, CUBE_CACHE_DEFAULT_BUDGET, 1);
+  CubeHistConfig(ctx, 1);
+  ArrayEach(Want*, wants, w) {
+    BufFree(w);
+  }
+}
+
+// sweep[v] must be CubeCalc for at least v of the stat, blocking or in small steps
+static
+void checkCalcSweep(CubeContext* ctx) {
+  static Want const stats[] = { WantStat(ATT, 0), WantStat(BOSS, 0), WantStat(IED, 0) };
+  Want* want = 0;
+  size_t n = 0, steps = 0;
+  ArrayEach(CheckItem const, checkItems, it) {
+    ArrayEach(Want const, stats, st) {
+      float* sweep = CubeCalcSweep(ctx, st->lineHi, st->lineLo, it->category, it->cube, it->tier,
+        it->lvl, it->region);
+      float* stepped = 0;
+      CubeCalcTask* t = CubeCalcSweepStart(ctx, st->lineHi, st->lineLo, it->category, it->cube,
+        it->tier, it->lvl, it->region, &stepped);
+      if (!checkSteps(t, &steps) || !sweep || BufLen(stepped) != BufLen(sweep)) {
+        fprintf(stderr, "cube 0x%x: sweep failed\n", it->cube);
+        ++failures;
+        goto next;
+      }
+      BufEachi(sweep, v) {
+        BufClear(want);
+        *BufAlloc(&want) = *st;
+        BufAt(want, -1).value = (int)v;
+        *BufAlloc(&want) = WantOp(AND, 1);
+        float p = CubeCalc(ctx, want, it->category, it->cube, it->tier, it->lvl, it->region, 0);
+        if (!checkClose(sweep[v], p) || !checkClose(stepped[v], p)) {
+          fprintf(stderr, "cube 0x%x: sweep[%zu] is %.9g, %.9g stepped, CubeCalc %.9g\n",
+            it->cube, (size_t)v, sweep[v], stepped[v], p);
+          ++failures;
+          break;
+        }
+        ++n;
+      }
+next:
+      BufFree(&sweep);
+      BufFree(&stepped);
+    }
+  }
+  printf("sweep: %zu amounts\n", n);
+  BufFree(&want);
+}
+
+// every cell of the matrix must be CubeCalc for that item or -1 if the item doesn't exist,
+// blocking or in small steps
+static
+void checkMatrix(CubeContext* ctx) {
+  static Cube const cubes[] = { RED, BLACK, VIOLET };
+  static Tier const tiers[] = { EPIC, LEGENDARY };
+  static Region const regions[] = { GMS, KMS };
+  static int const levels[] = { 150, 200 };
+  Cube* cubeBuf = 0;
+  Tier* tierBuf = 0;
+  Region* regionBuf = 0;
+  int* levelBuf = 0;
+  ArrayEach(Cube const, cubes, x) {
+    *BufAlloc(&cubeBuf) = *x;
+  }
+  ArrayEach(Tier const, tiers, x) {
+    *BufAlloc(&tierBuf) = *x;
+  }
+  ArrayEach(Region const, regions, x) {
+    *BufAlloc(&regionBuf) = *x;
+  }
+  ArrayEach(int const, levels, x) {
+    *BufAlloc(&levelBuf) = *x;
+  }
+
+  Want* want = 0;
+  size_t n = 0, steps = 0;
+  ArrayEach(CheckWant const, checkWants, w) {
+    checkWantBuf(&want, w);
+    float* matrix = CubeCalcMatrix(ctx, want, WEAPON, cubeBuf, tierBuf, regionBuf, levelBuf);
+    float* stepped = 0;
+    CubeCalcTask* t = CubeCalcMatrixStart(ctx, want, WEAPON, cubeBuf, tierBuf, regionBuf,
+      levelBuf, &stepped);
+    if (!checkSteps(t, &steps) || !matrix || BufLen(stepped) != BufLen(matrix)) {
+      fprintf(stderr, "matrix failed\n");
+      ++failures;
+      goto next;
+    }
+    size_t i = 0;
+    ArrayEach(Cube const, cubes, cube) {
+      ArrayEach(Tier const, tiers, tier) {
+        ArrayEach(Region const, regions, region) {
+          ArrayEach(int const, levels, lvl) {
+            float p = CubeCalc(ctx, want, WEAPON, *cube, *tier, *lvl, *region, 0);
+            if ((matrix[i] >= 0 && !checkClose(matrix[i], p)) || stepped[i] != matrix[i]) {
+              fprintf(stderr, "cube 0x%x tier %d region 0x%x level %d: matrix %.9g, "
+                "%.9g stepped, CubeCalc %.9g\n", *cube, *tier, *region, *lvl, matrix[i],
+                stepped[i], p);
+              ++failures;
+            }
+            n += matrix[i] >= 0;
+            ++i;
+          }
+        }
+      }
+    }
+next:
+    BufFree(&matrix);
+    BufFree(&stepped);
+  }
+  if (!n) {
+    fprintf(stderr, "no item of the matrix exists\n");
+    ++failures;
+  }
+  printf("matrix: %zu cells\n", n);
+  BufFree(&want);
+  BufFree(&cubeBuf);
+  BufFree(&tierBuf);
+  BufFree(&regionBuf);
+  BufFree(&levelBuf);
+}
+
+int main() {
+  CubeContext* ctx = CubeContextNew(0);
+  if (!ctx) {
+    return 1;
+  }
+  checkOptimize(ctx);
+  checkCacheSweep(ctx);
+  checkSim(ctx);
+  checkTop(ctx);
+  checkGrouped(ctx);
+  checkStep(ctx);
+  checkCalcSweep(ctx);
+  checkMatrix(ctx);
+  checkPlan(ctx);
+  checkStrategies(ctx);
+  checkStrategiesUnreachable(ctx);
+  CubeContextFree(ctx);
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  puts("all checks passed");
+  return 0;
+}
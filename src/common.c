@@ -73,15 +73,18 @@ static void linesFree(Map* cubeData) {
       Map* tierData = MapGet(categoryData, *categoryMask);
       MapFree(tierData);
     }
+    MapFree(categoryData);
     BufFree(&categories);
   }
+  MapFree(cubeData);
   BufFree(&cubes);
 }
 
-void kmsFree() { linesFree(kms); }
-void tmsFree() { linesFree(tms); }
-void famsFree() { linesFree(fams); }
-void famsCardFree() { linesFree(famsCard); }
+// the globals are reset so the data can be initialized again
+void kmsFree() { linesFree(kms); kms = 0; }
+void tmsFree() { linesFree(tms); tms = 0; }
+void famsFree() { linesFree(fams); fams = 0; }
+void famsCardFree() { linesFree(famsCard); famsCard = 0; }
 
 void valueGroupsFree() {
   ArrayEachi(valueGroups, i) {
@@ -98,6 +101,8 @@ void valueGroupsFree() {
       MapFree(hi);
       BufFree(&hiKeys);
     }
+    MapFree(tiers);
+    valueGroups[i] = 0;
     BufFree(&tierKeys);
   }
 }
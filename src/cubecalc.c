@@ -3,13 +3,57 @@
 
 #include "utils.c"
 
-// NOTE: CubeGlobalInit MUST be called before calling anything else from this header
-// other functions are thread safe, but GlobalInit/GlobalFree must be called once and not
-// concurrently
-void CubeGlobalInit();
-void CubeGlobalFree();
+// everything the calculator works with lives in a CubeContext: the line data it calculates from,
+// the caches built on top of it and the parallel for. contexts don't share anything mutable, so
+// any number of them can be used side by side with different data. every function that takes a
+// context is thread safe, free the context once nothing is using it anymore
+typedef struct _CubeContext CubeContext;
 
-// lines or line combinations as columns. each column is a Buf
+// lines that can't appear more than max times in the same combo. cubes, categories and regions
+// are masks of the items the rule applies to, 0 means all of them
+typedef struct _LineRule {
+  int lineHi, lineLo;
+  int max;
+  int cubes, categories, regions;
+} LineRule;
+
+// the data a context calculates from, laid out like the tables in generated.c. value group i has
+// the values in valueGroups[i] and applies to items matching valueGroupsCubeMask[i] and friends
+// up to level valueGroupsMaxLevel[i], see ValueGroupFind. lineRules are the rules for impossible
+// combos, see ForbiddenInit. everything is only read and must stay valid until every context
+// using it is freed
+typedef struct _CubeDataset {
+  Map* primeChances;
+  Map* kms;
+  Map* tms;
+  Map* fams;
+  Map* famsCard;
+  Map* const* valueGroups;
+  size_t valueGroupsLen;
+  int const* valueGroupsMaxLevel;
+  int const* valueGroupsCubeMask;
+  int const* valueGroupsCategoryMask;
+  int const* valueGroupsRegionMask;
+  LineRule const* lineRules;
+  size_t lineRulesLen;
+} CubeDataset;
+
+// create a context that calculates from data, or from the data in generated.c if data is NULL.
+// the generated data is built by the first context that needs it and freed with the last one.
+// returns NULL on failure
+CubeContext* CubeContextNew(CubeDataset const* data);
+void CubeContextFree(CubeContext* ctx);
+
+// big calculations are split into chunks that are ran through parallelFor. it must call
+// func(data, i) for every i in [0, n) and only return once they are all done. the calls can
+// happen in any order and on any thread. by default everything runs on the calling thread.
+// MTParallelFor from multithread.c fits this
+typedef void CubeTaskFunc(void* data, size_t i);
+typedef void CubeParallelForFunc(CubeTaskFunc* func, void* data, size_t n);
+void CubeSetParallelFor(CubeContext* ctx, CubeParallelForFunc* parallelFor);
+
+// lines or line combinations as columns. each column is a Buf. matching combos are returned as
+// Combos, which are much more compact
 typedef struct _Lines {
   int* lineHi;
   int* lineLo;
@@ -21,6 +65,53 @@ typedef struct _Lines {
 
 void LinesFree(Lines* l);
 
+// a line's lineHi and lineLo packed in a single mask, so a line matches a mask of stats with a
+// single AND
+#define LineMask(hi, lo) (((uint64_t)(uint32_t)(hi) << 32) | (uint32_t)(lo))
+#define LineMaskHi(m) ((int)((m) >> 32))
+#define LineMaskLo(m) ((int)(uint32_t)(m))
+
+// an entry of the line dictionary of Combos
+typedef struct _ComboLine {
+  uint64_t mask; // see LineMask
+  float prob;
+  int value;
+  int prime;
+} ComboLine;
+
+// line combinations as small indices into a dictionary of lines. index has comboSize indices
+// into lines for each combo. the probability of a combo element is the probability of its line
+// times the chance of its slot rolling prime or not, from slotMul (comboSize non-prime chances
+// followed by comboSize prime chances). see CombosProb
+//
+// grouped combos (see CubeCalcGrouped) have the lines of each combo in ascending order and
+// stand for every ordering of those lines. groupProb and groupPerms have the total probability
+// and the number of orderings of each combo. groupProb includes the same cube multiplier as
+// CubeCalc (1/3 for uni), so all the groups add up to its result. prime and non-prime lines are
+// different lines, so each prime pattern of the same stats is its own group
+typedef struct _Combos {
+  ComboLine* lines;
+  uint8_t* index;
+  float* slotMul;
+  size_t comboSize;
+  float* groupProb;
+  uint32_t* groupPerms;
+} Combos;
+
+void CombosFree(Combos* c);
+
+// deep copy combos. dst struct should be initialized to zero
+void CombosDup(Combos* dst, Combos const* src);
+
+// number of combos
+size_t CombosNum(Combos const* c);
+
+// line of the i-th combo element
+#define CombosLine(c, i) (&(c)->lines[(c)->index[i]])
+
+// probability of the i-th combo element
+float CombosProb(Combos const* c, size_t i);
+
 // format line into a string such as MESO_ONLY | DROP_ONLY
 char* LineToStr(int hi, int lo);
 
@@ -77,7 +168,7 @@ typedef enum Region Region;
 //
 // - lvl: the level of the item
 // - outCombos: if non-NULL, this pointer will be set to the matching combos data.
-//              you are expected to free this yourself using LinesFree
+//              you are expected to free this yourself using CombosFree
 //
 // wantBuf defines the combination of stats we're looking for. it's a simple stack machine
 // expression language where each element either pushes an operand on the stack or calls an
@@ -120,33 +211,284 @@ typedef enum Region Region;
 //   #include <math.h>
 //
 //   int main() {
-//     CubeGlobalInit();
+//     CubeContext* ctx = CubeContextNew(0);
 //
 //     static const BufH(Want, want,
 //       WantStat(ATT, 33),
 //       WantOp(AND, -1),
 //     );
 //
-//     float p = CubeCalc(want.data, WEAPON, BONUS, LEGENDARY, 200, GMS, 0);
+//     float p = CubeCalc(ctx, want.data, WEAPON, BONUS, LEGENDARY, 200, GMS, 0);
 //     if (p > 0) {
 //       printf("1 in %.0f\n", round(1 / p));
 //     } else {
 //       puts("impossible");
 //     }
 //
-//     CubeGlobalFree();
+//     CubeContextFree(ctx);
 //     return 0;
 //   }
 //
 float CubeCalc(
+  CubeContext* ctx,
   Want const* wantBuf,
   Category category,
   Cube cube,
   Tier tier,
   int lvl,
   Region region,
-  Lines* outCombos
+  Combos* outCombos
+);
+
+// same as CubeCalc for n wants on the same item. the probability of wantBufs[i] is stored in
+// results[i] and, if outCombos is non-NULL, its matching combos in outCombos[i].
+// wants that mention the same stats are calculated in a single pass over the combos, so this
+// is much faster than calling CubeCalc n times when you are comparing several thresholds.
+// returns 0 if any of the wants failed, their result is 0
+int CubeCalcBatch(
+  CubeContext* ctx,
+  Want const* const* wantBufs,
+  size_t n,
+  Category category,
+  Cube cube,
+  Tier tier,
+  int lvl,
+  Region region,
+  float* results,
+  Combos* outCombos
+);
+
+// CubeCalcBatch that can be spread over several calls, for single threaded programs that can't
+// block for long. wantBufs, results and outCombos must stay valid until the task is freed.
+// CubeCalcStep works for about budgetNs nanoseconds and returns non-zero once every result has
+// been stored. if budgetNs is 0 it runs until done like CubeCalcBatch, using the parallel for.
+// CubeCalcTaskFree returns what CubeCalcBatch would have returned, freeing a task that is not
+// done cancels it and returns 0
+typedef struct _CubeCalcTask CubeCalcTask;
+CubeCalcTask* CubeCalcStart(
+  CubeContext* ctx,
+  Want const* const* wantBufs,
+  size_t n,
+  Category category,
+  Cube cube,
+  Tier tier,
+  int lvl,
+  Region region,
+  float* results,
+  Combos* outCombos
 );
+int CubeCalcStep(CubeCalcTask* t, long budgetNs);
+int CubeCalcTaskFree(CubeCalcTask* t);
+
+// monotonic wall clock time in nanoseconds, what the budget of CubeCalcStep is measured with
+intmax_t CubeClockNs();
+
+// the k most likely combos that match wantBuf, most likely first. combos are generated
+// best-first so this stays fast no matter how many combos match, unlike outCombos in CubeCalc.
+// *pnumCombos is set to the total number of matching combos. when there are more than k, that
+// takes a pass over the multisets of lines like CubeCalcGrouped. the probability of wantBuf is
+// not calculated, use CubeCalc without outCombos for that. returns 0 on failure
+int CubeCalcTop(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumCombos);
+
+// same as CubeCalcTop, but combos that only differ by the order of the lines are grouped (see
+// Combos). the k most likely groups are stored, most likely first, and *pnumGroups is set to the
+// total number of matching groups. every match is walked, but as multisets of lines, so this is
+// still much faster than outCombos in CubeCalc
+int CubeCalcGrouped(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube,
+  Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumGroups);
+
+// calculate wantBuf for every combination of cubes, tiers, regions and levels (Buf's) on an
+// item of the given category. returns a Buf of probabilities laid out like
+// result[cube][tier][region][level] that you need to free, or NULL if wantBuf is invalid.
+// combinations that don't exist, like a tier the cube can't roll, are set to -1.
+// wantBuf is optimized for each item (see WantOptimize) and cached like CubeCalc, levels that
+// share values are only calculated once
+float* CubeCalcMatrix(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube const* cubes, Tier const* tiers, Region const* regions, int const* levels);
+
+// probability of rolling at least v of the stat (lineHi, lineLo as in WantStat) for every v
+// from 0 to the highest amount the item can roll, in a single pass. returns a Buf that you
+// need to free where result[v] is the probability, or NULL on failure.
+// result[0] is the chance of rolling anything at all, which is only 1 when no combos are
+// forbidden
+float* CubeCalcSweep(CubeContext* ctx, int lineHi, int lineLo, Category category, Cube cube,
+  Tier tier, int lvl, Region region);
+
+// CubeCalcTop, CubeCalcGrouped, CubeCalcMatrix and CubeCalcSweep as a CubeCalcTask, ran with
+// CubeCalcStep and freed with CubeCalcTaskFree. the outputs are only set once CubeCalcStep
+// returns non-zero and must stay valid until then. the Bufs of the matrix and the sweep are
+// stored in *presult, which stays NULL on failure. cubes, tiers, regions and levels are only
+// read by CubeCalcMatrixStart
+CubeCalcTask* CubeCalcTopStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube cube, Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumCombos);
+CubeCalcTask* CubeCalcGroupedStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube cube, Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumGroups);
+CubeCalcTask* CubeCalcMatrixStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube const* cubes, Tier const* tiers, Region const* regions, int const* levels,
+  float** presult);
+CubeCalcTask* CubeCalcSweepStart(CubeContext* ctx, int lineHi, int lineLo, Category category,
+  Cube cube, Tier tier, int lvl, Region region, float** presult);
+
+typedef struct _CubeSimResult {
+  double p;      // estimated probability
+  double lo, hi; // 95% confidence interval
+  size_t rolls, hits;
+  float exact;   // CubeCalc for the same want and item, to compare against
+} CubeSimResult;
+
+// monte carlo estimate of the probability of rolling wantBuf, to validate CubeCalc.
+// combos are rolled one slot at a time with the same lines, prime chances and forbidden rules as
+// CubeCalc (lines that wantBuf doesn't mention are folded into ANY the same way). combos that
+// break a forbidden rule count as rolls that don't match, and the unicube line selection is
+// applied as the same multiplier, so the estimate converges to CubeCalc's result.
+//
+// rolls are split into fixed size blocks ran through the parallel for (see CubeSetParallelFor).
+// every roll draws from a counter based rng keyed by seed and the index of the roll, so the
+// result only depends on seed and rolls, not on the number of threads.
+//
+// if importance is non-zero, half of the draws favor the lines that count towards wantBuf and
+// each roll is weighted by how much more likely it was made. this keeps the estimate unbiased
+// while being much more precise for very rare wants.
+//
+// returns 0 on failure
+int CubeSim(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, size_t rolls, uint64_t seed, int importance, CubeSimResult* out);
+
+// Tier values go from 1 (BASE) to 6 (LEGENDARY), arrays indexed by Tier have this many elements
+#define CUBE_NUM_TIERS 7
+
+// a cubing plan that can tier up along the way: the item starts at tier from and is cubed until
+// it rolls the target. a cube used at tier t tiers the item up with chance tierUp[t], then the
+// lines are rolled at the tier the item ends up on. p[t] is the chance that a roll at tier t is
+// the target, rolls below the target tier count as misses.
+//
+// the plan is an absorbing markov chain over the tiers, tiers only go up so it's solved in closed
+// form by back substitution. expected and stddev are 0 if there's a chance that the target is
+// never reached
+typedef struct _CubePlan {
+  int from, target; // Tier
+  double p[CUBE_NUM_TIERS];
+  double tierUp[CUBE_NUM_TIERS];
+  double expected; // average number of cubes
+  double stddev;
+} CubePlan;
+
+// fill out a plan for rolling wantBuf with cube from tier from, counting rolls at tier target or
+// higher. the tier up chances are not in the data, tierUp has CUBE_NUM_TIERS chances indexed by
+// Tier, NULL never tiers up. returns 0 on failure
+int CubeCalcPlan(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier from,
+  Tier target, int lvl, Region region, double const* tierUp, CubePlan* out);
+
+// solve a plan that has from, target, p and tierUp filled in, for example to mix cubes or reuse
+// probabilities. returns 0 on failure
+int CubePlanSolve(CubePlan* plan);
+
+// number of cubes that reaches the target with percent% chance, like
+// ProbToGeoDistrQuantileDingle but for the whole plan. 0 if the target can't be reached
+intmax_t CubePlanQuantile(CubePlan const* plan, double percent);
+
+// a cube that CubeCalcStrategies can use. cost is the price of a single cube and tierUp the
+// chance of tiering up when it's used at each tier, indexed by Tier like in CubePlan
+typedef struct _CubeStrategyCube {
+  int cube; // Cube
+  double cost;
+  double tierUp[CUBE_NUM_TIERS];
+} CubeStrategyCube;
+
+// use cube up until the item reaches switchTier, then cube roll. when switchTier is the starting
+// tier, up and roll are the same cube
+typedef struct _CubeStrategy {
+  int up, roll;   // Cube
+  int switchTier; // Tier
+  double cost;     // expected cost
+  double expected; // expected number of cubes
+} CubeStrategy;
+
+// find the cheapest ways to roll wantBuf on an item that starts at tier from, counting rolls at
+// tier target or higher like CubeCalcPlan. every cube in cubes is tried on its own and as the
+// cube used to tier up to each tier before switching to another one.
+//
+// the chance of each cube at each tier is calculated at most once, on the parallel for, and only
+// when a strategy that needs it can still make it into the k cheapest. the cost of tiering up to
+// the target tier doesn't need any calculation, strategies are tried from the cheapest tier up
+// and skipped once that alone costs more than the k-th cheapest found so far.
+//
+// returns a Buf of the k cheapest strategies (all of them if k is 0), cheapest first, that you
+// need to free. strategies that might never reach the target are left out. NULL on failure
+CubeStrategy* CubeCalcStrategies(CubeContext* ctx, Want const* wantBuf, Category category,
+  int lvl, Region region, Tier from, Tier target, CubeStrategyCube const* cubes, size_t numCubes,
+  size_t k);
+
+// simplify wantBuf for an item and store the result in *pout. the result is equivalent to
+// wantBuf for that item but cheaper to calculate:
+//
+// - nested operators of the same kind are flattened and duplicate operands are removed
+// - thresholds implied by another threshold on the same stat are removed
+//   (21+ att or 30+ att is 21+ att)
+// - thresholds that the item can't reach become false, thresholds of 0 become true and the
+//   operators are folded accordingly. the stats they mentioned are still mentioned by a 0
+//   threshold, since they change which lines are told apart
+// - operands are sorted so that equivalent wants give the same result (see WantHash)
+//
+// returns 0 if wantBuf is invalid. *pout is left empty if nothing can match wantBuf
+int WantOptimize(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, Want** pout);
+
+// stable hash of wantBuf, meant to be used on the output of WantOptimize
+uint64_t WantHash(Want const* wantBuf);
+
+// CubeCalc results are cached per context, keyed by wantBuf and the line data and value group
+// it resolves to, so levels that share values share entries. wantBuf is used as is, pass it
+// through WantOptimize first so that equivalent wants hit the same entry
+// probes is the number of slots of the index that hits and misses looked at. a lookup stops at
+// the first empty slot, so it stays at a few per lookup no matter how many entries there are
+typedef struct _CubeCacheStats {
+  size_t hits, misses, evictions, probes;
+  size_t entries, bytes, budget;
+} CubeCacheStats;
+
+// set the memory budget in bytes (0 disables the cache). least recently used entries are
+// evicted when it's exceeded. if keepCombos is non-zero, the matching combos are also kept so
+// calls with outCombos can be served from the cache. defaults to 64MB with combos
+void CubeCacheConfig(CubeContext* ctx, size_t budget, int keepCombos);
+void CubeCacheClear(CubeContext* ctx);
+CubeCacheStats CubeCacheGetStats(CubeContext* ctx);
+
+// everything CubeCalc needs that doesn't depend on the thresholds: the lines of the item
+// filtered down to the stats mentioned by a want, the chance of each line for each slot and
+// the forbidden line rules. configurations are built once, cached in their context and shared
+// between threads.
+// changing only the amounts in a want will reuse the same configuration.
+//
+// when only the probability is needed, a configuration that is queried more than once also keeps
+// a joint histogram of the stat values over every combo. later wants on the same stats are
+// answered from the histogram no matter the amounts or the AND/OR structure, without going
+// through the combos again. on by default, pass 0 to always calculate from scratch
+void CubeHistConfig(CubeContext* ctx, int enable);
+typedef struct _CubeConfig CubeConfig;
+
+// get the configuration for an item and the stats mentioned in wantBuf.
+// returns NULL on failure. release it with CubeConfigRelease when done
+CubeConfig* CubeConfigGet(CubeContext* ctx, Category category, Cube cube, Tier tier, int lvl,
+  Region region, Want const* wantBuf);
+void CubeConfigRelease(CubeConfig* c);
+void CubeConfigClear(CubeContext* ctx); // free all configurations that are not in use
+
+// same as CubeCalc but on a prepared configuration. wantBuf can't mention stats that were not
+// in the wantBuf the configuration was made for. the probability is stored in *p.
+// returns 0 on failure
+int CubeConfigCalc(CubeConfig const* c, Want const* wantBuf, float* p, Combos* outCombos);
+
+// same as CubeCalcBatch but on a prepared configuration and without going through the cache
+int CubeConfigCalcBatch(CubeConfig const* c, Want const* const* wantBufs, size_t n, float* p,
+  Combos* outCombos);
+
+// same as CubeCalcTop and CubeCalcGrouped but on a prepared configuration
+int CubeConfigCalcTop(CubeConfig const* c, Want const* wantBuf, size_t k, Combos* outCombos,
+  size_t* pnumCombos);
+int CubeConfigCalcGrouped(CubeConfig const* c, Want const* wantBuf, size_t k, Combos* outCombos,
+  size_t* pnumGroups);
 
 // structs and enums used for wantBuf. usually you don't need to use these directly
 #define WantOps(f) \
@@ -213,6 +555,8 @@ DefEnumNames(WantType);
 #endif
 
 #include <string.h>
+#include <math.h>
+#include <time.h>
 
 char* LineToStr(int hi, int lo) {
   char* res = 0;
@@ -259,24 +603,106 @@ char const* _EnumToStr(int const* vals, char const* const* names, size_t n, int
   return 0;
 }
 
+//
+// CubeContext
+//
+// the caches of a context are shared by every thread that uses it, each has its own lock
+//
+
+#ifdef NO_MULTITHREAD
+typedef int CubeMutex;
+#define CUBE_MUTEX_INITIALIZER 0
+#define CubeMutexInit(m) (void)(m)
+#define CubeMutexFree(m) (void)(m)
+#define CubeLock(m) (void)(m)
+#define CubeUnlock(m) (void)(m)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t CubeMutex;
+#define CUBE_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define CubeMutexInit(m) pthread_mutex_init(m, 0)
+#define CubeMutexFree(m) pthread_mutex_destroy(m)
+#define CubeLock(m) pthread_mutex_lock(m)
+#define CubeUnlock(m) pthread_mutex_unlock(m)
+#endif
+
+typedef struct _CubeCacheEntry CubeCacheEntry;
+typedef struct _CubeValuesEntry CubeValuesEntry;
+
+// dimensions of the lookup tables, indexed by bit position. masks that combine more than one bit
+// or don't fit are looked up the slow way
+#define CUBE_NUM_CUBES ArrayLength(cubeValues)
+#define CUBE_NUM_CATEGORIES (ArrayLength(categoryValues) - CATEGORY_NUM_COMBINED)
+#define CUBE_NUM_REGIONS ArrayLength(regionValues)
+
+// value groups never apply past this level
+#define CUBE_MAX_LEVEL 300
+
+struct _CubeContext {
+  CubeDataset data;
+  int builtin; // data is the generated data, see CubeContextNew
+
+  // DataFind for single cube and category bits, filled by DataIndexInit
+  LineData const* lineData[CUBE_NUM_CUBES][CUBE_NUM_CATEGORIES][CUBE_NUM_TIERS];
+
+  // ValueGroupMatch for single cube, category and region bits, filled by ValueGroupIndexInit
+  uint16_t valueGroupLevelBucket[CUBE_MAX_LEVEL + 1];
+  size_t valueGroupLevels;
+  size_t* valueGroupIndex;
+
+  int ruleRegions; // 1 if any line rule depends on the region, see CubeRuleRegion
+
+  CubeParallelForFunc* parallelFor;
+
+  // CubeCache, guarded by cacheMutex
+  CubeMutex cacheMutex;
+  HashIndex cacheIndex;
+  CubeCacheEntry* cacheHead;
+  CubeCacheEntry* cacheTail;
+  CubeCacheStats cacheStats;
+  int cacheKeepCombos;
+
+  // value columns, see LinesValuesFind. guarded by valuesMutex, entries never change once added
+  CubeMutex valuesMutex;
+  HashIndex valuesIndex;
+  CubeValuesEntry** valuesEntries;
+
+  // CubeConfig, guarded by configMutex
+  CubeMutex configMutex;
+  CubeConfig** configs;
+  size_t configClock;
+  int histEnable;
+};
+
 static
-Map* DataFindMap(int cubeMask) {
+Map* DataFindMap(CubeDataset const* d, int cubeMask) {
   if (cubeMask & FAMILIAR) {
-    return fams;
+    return d->fams;
   }
   if (cubeMask & RED_FAM_CARD) {
-    return famsCard;
+    return d->famsCard;
   }
   if (cubeMask & (VIOLET | EQUALITY | UNI)) {
-    return tms;
+    return d->tms;
+  }
+  return d->kms;
+}
+
+// bit position of a mask with a single bit set, -1 if it has more bits or the bit is >= n
+static
+int MaskIndex(int mask, size_t n) {
+  RangeBefore(n, i) {
+    if (mask == 1 << i) {
+      return i;
+    }
   }
-  return kms;
+  return -1;
 }
 
 static
-LineData const* DataFind(int categoryMask, int cubeMask, int tier) {
+LineData const* DataScan(CubeDataset const* d, int categoryMask, int cubeMask, int tier) {
   LineData const* res = 0;
-  Map* data = DataFindMap(cubeMask);
+  Map* data = DataFindMap(d, cubeMask);
   int* cubes = MapKeys(data);
   BufEach(int, cubes, cube) {
     if (*cube & cubeMask) {
@@ -301,6 +727,29 @@ LineData const* DataFind(int categoryMask, int cubeMask, int tier) {
   return res;
 }
 
+// the maps are never modified after the context is created, so every lookup DataFind can answer
+// is resolved once here
+static
+void DataIndexInit(CubeContext* ctx) {
+  RangeBefore(CUBE_NUM_CUBES, cube) {
+    RangeBefore(CUBE_NUM_CATEGORIES, category) {
+      Range(BASE, LEGENDARY, tier) {
+        ctx->lineData[cube][category][tier] = DataScan(&ctx->data, 1 << category, 1 << cube, tier);
+      }
+    }
+  }
+}
+
+static
+LineData const* DataFind(CubeContext const* ctx, int categoryMask, int cubeMask, int tier) {
+  int cube = MaskIndex(cubeMask, CUBE_NUM_CUBES);
+  int category = MaskIndex(categoryMask, CUBE_NUM_CATEGORIES);
+  if (cube >= 0 && category >= 0 && tier >= 0 && tier < CUBE_NUM_TIERS) {
+    return ctx->lineData[cube][category][tier];
+  }
+  return DataScan(&ctx->data, categoryMask, cubeMask, tier);
+}
+
 typedef union _LineFields {
   Lines data;
   int* fields[offsetof(Lines, prime) / sizeof(void*)];
@@ -374,50 +823,170 @@ void LinesIndex(Lines* l, intmax_t* indices) {
 
 #undef F
 
+void CombosFree(Combos* c) {
+  BufFree(&c->lines);
+  BufFree(&c->index);
+  BufFree(&c->slotMul);
+  BufFree(&c->groupProb);
+  BufFree(&c->groupPerms);
+}
+
+void CombosDup(Combos* dst, Combos const* src) {
+  dst->lines = BufDup((ComboLine*)src->lines);
+  dst->index = BufDup((uint8_t*)src->index);
+  dst->slotMul = BufDup((float*)src->slotMul);
+  dst->comboSize = src->comboSize;
+  dst->groupProb = BufDup((float*)src->groupProb);
+  dst->groupPerms = BufDup((uint32_t*)src->groupPerms);
+}
+
+static
+size_t CombosBytes(Combos const* c) {
+  return BufLen(c->lines) * sizeof(c->lines[0]) + BufLen(c->index) * sizeof(c->index[0]) +
+    BufLen(c->slotMul) * sizeof(c->slotMul[0]) +
+    BufLen(c->groupProb) * sizeof(c->groupProb[0]) +
+    BufLen(c->groupPerms) * sizeof(c->groupPerms[0]);
+}
+
+size_t CombosNum(Combos const* c) {
+  return c->comboSize ? BufLen(c->index) / c->comboSize : 0;
+}
+
+float CombosProb(Combos const* c, size_t i) {
+  ComboLine const* line = CombosLine(c, i);
+  return line->prob * c->slotMul[i % c->comboSize + line->prime * c->comboSize];
+}
+
+// the value of every line in ld followed by the ANY line, from value group group at tier.
+// returns a Buf that you need to free, NULL on failure
 static
-int LinesCatData(Lines* l, LineData const* ld, size_t group, int tier) {
-  Map* hi = MapGet(valueGroups[group], tier);
+int* LinesValues(CubeDataset const* d, LineData const* ld, size_t group, int tier) {
+  Map* hi = MapGet(d->valueGroups[group], tier);
   if (!hi) {
     fprintf(stderr, "no data for tier %d\n", tier);
     return 0;
   }
-  if (ld) {
-    size_t start = BufLen(l->lineHi);
-    BufCat(&l->lineHi, ld->lineHi);
-    BufCat(&l->lineLo, ld->lineLo);
-    BufCat(&l->onein, ld->onein);
-
-    // ANY line
-    *BufAlloc(&l->lineHi) = ANY_HI;
-    *BufAlloc(&l->lineLo) = ANY_LO;
-    *BufAlloc(&l->onein) = 1;
-
-    BufEachiRange(l->lineHi, start, -1, i) {
-      int lineHi = l->lineHi[i];
-      int lineLo = l->lineLo[i];
-      Map* lo = MapGet(hi, lineHi);
-      if (!lo || !MapHas(lo, lineLo)) {
-        char* s = LineToStr(lineHi, lineLo);
-        fprintf(stderr, "no value for %s\n", s);
-        BufFree(&s);
-        return 0;
-      }
-      // int value = valueGroups[group][tier][lineHi][lineLo]
-      *BufAlloc(&l->value) = (int)(intptr_t)MapGet(lo, lineLo);
+  int* res = 0;
+  (void)BufReserve(&res, BufLen(ld->lineHi) + 1);
+  BufEachi(res, i) {
+    int lineHi = i < (intmax_t)BufLen(ld->lineHi) ? ld->lineHi[i] : ANY_HI;
+    int lineLo = i < (intmax_t)BufLen(ld->lineHi) ? ld->lineLo[i] : ANY_LO;
+    Map* lo = MapGet(hi, lineHi);
+    if (!lo || !MapHas(lo, lineLo)) {
+      char* s = LineToStr(lineHi, lineLo);
+      fprintf(stderr, "no value for %s\n", s);
+      BufFree(&s);
+      BufFree(&res);
+      return 0;
     }
+    // int value = valueGroups[group][tier][lineHi][lineLo]
+    res[i] = (int)(intptr_t)MapGet(lo, lineLo);
   }
-  return 1;
+  return res;
+}
+
+struct _CubeValuesEntry {
+  LineData const* ld;
+  size_t group;
+  int tier;
+  int* values;
+};
+
+static
+uint64_t LinesValuesHash(LineData const* ld, size_t group, int tier) {
+  uintptr_t fields[3] = { (uintptr_t)ld, group, tier };
+  return HashBytes(fields, sizeof(fields), HASH_SEED);
+}
+
+// must be called with the lock held
+static
+int const* LinesValuesLookup(CubeContext* ctx, uint64_t hash, LineData const* ld, size_t group,
+  int tier)
+{
+  size_t cursor = 0;
+  for (uintptr_t v; (v = HashIndexNext(&ctx->valuesIndex, hash, &cursor));) {
+    CubeValuesEntry const* e = (CubeValuesEntry const*)v;
+    if (e->ld == ld && e->group == group && e->tier == tier) {
+      return e->values;
+    }
+  }
+  return 0;
+}
+
+// the datasets never change after the context is created, so LinesValues is only called once
+// for each line data and value group. the result is shared by every thread and must not be
+// modified or freed. NULL on failure
+static
+int const* LinesValuesFind(CubeContext* ctx, LineData const* ld, size_t group, int tier) {
+  uint64_t hash = LinesValuesHash(ld, group, tier);
+  CubeLock(&ctx->valuesMutex);
+  int const* res = LinesValuesLookup(ctx, hash, ld, group, tier);
+  CubeUnlock(&ctx->valuesMutex);
+  if (res) {
+    return res;
+  }
+
+  // the map lookups are slow enough to not hold the lock while building the column, so check
+  // again before adding it in case another thread got here first
+  int* values = LinesValues(&ctx->data, ld, group, tier);
+  if (!values) {
+    return 0;
+  }
+  CubeLock(&ctx->valuesMutex);
+  res = LinesValuesLookup(ctx, hash, ld, group, tier);
+  if (!res) {
+    CubeValuesEntry* e = malloc(sizeof(CubeValuesEntry));
+    *e = (CubeValuesEntry){ .ld = ld, .group = group, .tier = tier, .values = values };
+    if (HashIndexAdd(&ctx->valuesIndex, hash, (uintptr_t)e)) {
+      *BufAlloc(&ctx->valuesEntries) = e;
+      res = values;
+      values = 0;
+    } else {
+      free(e);
+    }
+  }
+  CubeUnlock(&ctx->valuesMutex);
+  BufFree(&values);
+  return res;
+}
+
+static
+void LinesValuesClear(CubeContext* ctx) {
+  BufEach(CubeValuesEntry*, ctx->valuesEntries, e) {
+    BufFree(&(*e)->values);
+    free(*e);
+  }
+  BufFree(&ctx->valuesEntries);
+  HashIndexFree(&ctx->valuesIndex);
 }
 
 static
-int LinesInit(Lines* l, LineData const* dataPrime, LineData const* dataNonPrime,
-  size_t group, int tier)
+void LinesCatData(Lines* l, LineData const* ld, int const* values) {
+  BufCat(&l->lineHi, ld->lineHi);
+  BufCat(&l->lineLo, ld->lineLo);
+  BufCat(&l->onein, ld->onein);
+
+  // ANY line
+  *BufAlloc(&l->lineHi) = ANY_HI;
+  *BufAlloc(&l->lineLo) = ANY_LO;
+  *BufAlloc(&l->onein) = 1;
+
+  BufCat(&l->value, values);
+}
+
+static
+int LinesInit(CubeContext* ctx, Lines* l, LineData const* dataPrime,
+  LineData const* dataNonPrime, size_t group, int tier)
 {
   l->comboSize = 1;
-  if (!LinesCatData(l, dataPrime, group, tier)) return 0;
+  int const* values = LinesValuesFind(ctx, dataPrime, group, tier);
+  if (!values) return 0;
+  LinesCatData(l, dataPrime, values);
   size_t numPrimes = BufLen(l->lineHi);
   if (numPrimes == 1) return 0; // no lines found
-  if (!LinesCatData(l, dataNonPrime, group, tier - 1)) return 0;
+  values = LinesValuesFind(ctx, dataNonPrime, group, tier - 1);
+  if (!values) return 0;
+  LinesCatData(l, dataNonPrime, values);
   (void)BufReserve(&l->prime, ArrayBitElements(l->prime, BufLen(l->lineHi)));
   BufZero(l->prime);
   RangeBefore(numPrimes, i) {
@@ -427,114 +996,198 @@ int LinesInit(Lines* l, LineData const* dataPrime, LineData const* dataNonPrime,
 }
 
 static
-size_t ValueGroupFind(int cubeMask, int categoryMask, int regionMask, int level) {
-  int minLevel = 301;
-  size_t match = valueGroupsLen;
-  RangeBefore(valueGroupsLen, i) {
-    if ((valueGroupsCubeMask[i] & cubeMask) == cubeMask &&
-        (valueGroupsCategoryMask[i] & categoryMask) == categoryMask &&
-        (valueGroupsRegionMask[i] & regionMask) == regionMask &&
-        (valueGroupsMaxLevel[i] >= level))
+size_t ValueGroupScan(CubeDataset const* d, int cubeMask, int categoryMask, int regionMask,
+  int level)
+{
+  int minLevel = CUBE_MAX_LEVEL + 1;
+  size_t match = d->valueGroupsLen;
+  RangeBefore(d->valueGroupsLen, i) {
+    if ((d->valueGroupsCubeMask[i] & cubeMask) == cubeMask &&
+        (d->valueGroupsCategoryMask[i] & categoryMask) == categoryMask &&
+        (d->valueGroupsRegionMask[i] & regionMask) == regionMask &&
+        (d->valueGroupsMaxLevel[i] >= level))
     {
-      if (valueGroupsMaxLevel[i] < minLevel) {
-        minLevel = valueGroupsMaxLevel[i];
+      if (d->valueGroupsMaxLevel[i] < minLevel) {
+        minLevel = d->valueGroupsMaxLevel[i];
         match = i;
       }
     }
   }
-  if (match >= valueGroupsLen) {
-    fprintf(stderr, "couldn't match cube 0x%x category 0x%x region 0x%x level %d\n",
-      cubeMask, categoryMask, regionMask, level);
-  }
   return match;
 }
 
+// the match only changes at the max level of some group, so levels are mapped to the index of
+// the lowest max level >= level plus one, or 0 if there's none. the index has the match for each
+// of those levels
 static
-void WantFree(Want* w) {
-  if (w->type == WANT_MASK) BufFree(&w->mask);
+void ValueGroupIndexInit(CubeContext* ctx) {
+  CubeDataset const* d = &ctx->data;
+  int* levels = 0;
+  while (BufLen(levels) < d->valueGroupsLen) {
+    int level = CUBE_MAX_LEVEL + 1;
+    // next distinct max level
+    RangeBefore(d->valueGroupsLen, j) {
+      int prev = BufLen(levels) ? BufAt(levels, -1) : -1;
+      if (d->valueGroupsMaxLevel[j] > prev && d->valueGroupsMaxLevel[j] < level) {
+        level = d->valueGroupsMaxLevel[j];
+      }
+    }
+    if (level > CUBE_MAX_LEVEL) {
+      break;
+    }
+    *BufAlloc(&levels) = level;
+  }
+  size_t numLevels = BufLen(levels);
+
+  size_t bucket = 0;
+  RangeBefore(ArrayLength(ctx->valueGroupLevelBucket), level) {
+    while (bucket < numLevels && levels[bucket] < (int)level) {
+      ++bucket;
+    }
+    ctx->valueGroupLevelBucket[level] = bucket < numLevels ? bucket + 1 : 0;
+  }
+
+  ctx->valueGroupLevels = numLevels;
+  BufClear(ctx->valueGroupIndex);
+  RangeBefore(CUBE_NUM_CUBES, cube) {
+    RangeBefore(CUBE_NUM_CATEGORIES, category) {
+      RangeBefore(CUBE_NUM_REGIONS, region) {
+        BufEach(int, levels, level) {
+          *BufAlloc(&ctx->valueGroupIndex) =
+            ValueGroupScan(d, 1 << cube, 1 << category, 1 << region, *level);
+        }
+      }
+    }
+  }
+  BufFree(&levels);
 }
 
+// same as ValueGroupFind but doesn't complain when there's no match
 static
-void WantStackPop(Want* stack, intmax_t n) {
-  BufEachRange(Want, stack, -n, -1, w) {
-    WantFree(w);
+size_t ValueGroupMatch(CubeContext const* ctx, int cubeMask, int categoryMask, int regionMask,
+  int level)
+{
+  int cube = MaskIndex(cubeMask, CUBE_NUM_CUBES);
+  int category = MaskIndex(categoryMask, CUBE_NUM_CATEGORIES);
+  int region = MaskIndex(regionMask, CUBE_NUM_REGIONS);
+  if (cube >= 0 && category >= 0 && region >= 0 && level >= 0 && level <= CUBE_MAX_LEVEL &&
+      ctx->valueGroupLevelBucket[level])
+  {
+    size_t i = ((size_t)cube * CUBE_NUM_CATEGORIES + category) * CUBE_NUM_REGIONS + region;
+    return ctx->valueGroupIndex[i * ctx->valueGroupLevels +
+      ctx->valueGroupLevelBucket[level] - 1];
   }
-  BufHdr(stack)->len -= n;
+  return ValueGroupScan(&ctx->data, cubeMask, categoryMask, regionMask, level);
 }
 
 static
-void WantStackFree(Want** pstack) {
-  WantStackPop(*pstack, BufLen(*pstack));
-  BufFree(pstack);
+size_t ValueGroupFind(CubeContext const* ctx, int cubeMask, int categoryMask, int regionMask,
+  int level)
+{
+  size_t match = ValueGroupMatch(ctx, cubeMask, categoryMask, regionMask, level);
+  if (match >= ctx->data.valueGroupsLen) {
+    fprintf(stderr, "couldn't match cube 0x%x category 0x%x region 0x%x level %d\n",
+      cubeMask, categoryMask, regionMask, level);
+  }
+  return match;
 }
 
-// NOTE: LINE_A/B/C should NEVER be used with this
+// look up the line data for an item and fill l with every line it can roll, with values from
+// group (see ValueGroupFind). data is set to the prime and non-prime line data
 static
-void LinesMatch(Lines* l, int maskHi, int maskLo, intmax_t** pmatch, intmax_t** pmatchLo) {
-  BufClear(*pmatch);
-  BufClear(*pmatchLo);
-  BufMask(int, l->lineHi, *x & maskHi, pmatch);
-  BufMask(int, l->lineLo, *x & maskLo, pmatchLo);
-  BufOR(*pmatch, *pmatchLo);
+int CubeLinesInit(CubeContext* ctx, Lines* l, Category category, Cube cube, Tier tier,
+  size_t group, LineData const* data[2])
+{
+  CubeDataset const* d = &ctx->data;
+  data[0] = DataFind(ctx, category, cube, tier);
+  if (!data[0]) {
+    fprintf(stderr, "prime line data not found\n");
+    return 0;
+  }
+
+  data[1] = DataFind(ctx, category, cube, tier - 1);
+  if (!data[1]) {
+    fprintf(stderr, "non-prime line data not found\n");
+    return 0;
+  }
+
+  if (group >= d->valueGroupsLen || !d->valueGroups[group]) {
+    fprintf(stderr, "failed to find value group\n");
+    return 0;
+  }
+
+  return LinesInit(ctx, l, data[0], data[1], group, tier);
 }
 
-// match any combo that has at least numLines lines matching maskHi maskLo 
-// result stored in *pmatch
+// chance of rolling a prime line for each slot. NULL if the cube can't roll tier
 static
-void LinesAnyNCombo(
-  Lines* combos,
-  int numLines,
-  int maskHi, int maskLo,
-  intmax_t** pmatch, intmax_t** pmatchLo,
-  int** pcounts
-) {
-  LinesMatch(combos, maskHi, maskLo, pmatch, pmatchLo);
-
-  // create a Buf with repeated line counts for each combo
-  BufClear(*pcounts);
-  (void)BufReserve(pcounts, BufLen(combos->lineHi));
-  BufEachi(combos->lineHi, i) {
-    int count = 0;
-    RangeBefore(combos->comboSize, j) {
-      count += ArrayBitVal(*pmatch, i + j);
-    }
-    RangeBefore(combos->comboSize, j) {
-      (*pcounts)[i + j] = count;
-    }
-    i += combos->comboSize - 1;
+float const* PrimeChanceFind(CubeDataset const* d, Cube cube, Tier tier) {
+  Container* primeChance = MapGet(d->primeChances, cube);
+  if (!primeChance) {
+    return 0;
   }
+  switch (primeChance->type) {
+    case CONTAINER_BUF:
+      return primeChance->data;
+    case CONTAINER_MAP:
+      return MapGet(primeChance->data, tier);
+    default:
+      fprintf(stderr, "invalid prime chance container %d\n", primeChance->type);
+  }
+  return 0;
+}
 
-  // mask by line count on the repeated Buf. this will keep combos matching the line count
-  BufClear(*pmatch);
-  BufMask(int, *pcounts, *x >= numLines, pmatch);
+// quietly check if there's data to calculate anything for the item
+static
+int CubeItemExists(CubeContext const* ctx, Category category, Cube cube, Tier tier,
+  size_t group)
+{
+  CubeDataset const* d = &ctx->data;
+  return group < d->valueGroupsLen && d->valueGroups[group] &&
+    MapHas(d->valueGroups[group], tier) && MapHas(d->valueGroups[group], tier - 1) &&
+    DataFind(ctx, category, cube, tier) && DataFind(ctx, category, cube, tier - 1) &&
+    BufLen(PrimeChanceFind(d, cube, tier));
 }
 
+// NOTE: LINE_A/B/C should NEVER be used with this
 static
-int WantEval(int category, int cube, Lines* combos, Want const* wantBuf) {
-  Want* stack = 0;
-  int res = 0;
+int LineMatches(Lines const* l, intmax_t i, int maskHi, int maskLo) {
+  return (l->lineHi[i] & maskHi) || (l->lineLo[i] & maskLo);
+}
 
-  // filter all lines that don't match these stats
-  int maskHi = ANY_HI;
-  int maskLo = ANY_LO;
+// mask of all the stats mentioned in wantBuf
+static
+void WantMask(Want const* wantBuf, int* maskHi, int* maskLo) {
+  *maskHi = *maskLo = 0;
   BufEach(Want const, wantBuf, s) {
     if (s->type == WANT_STAT) {
-      maskHi |= s->lineHi;
-      maskLo |= s->lineLo;
+      *maskHi |= s->lineHi;
+      *maskLo |= s->lineLo;
     }
   }
+}
 
-  intmax_t* match = 0;
-  intmax_t* matchLo = 0;
-  int* counts = 0; // used for "any combination of N lines"
+// filter all lines that don't match the stats in the mask. the lines that are filtered out are
+// folded into the ANY lines. "one in" values are converted to probabilities (onein = 1/onein).
+// returns the number of prime lines left
+static
+intmax_t LinesPrepare(Lines* l, int maskHi, int maskLo) {
+  maskHi |= ANY_HI;
+  maskLo |= ANY_LO;
 
-  LinesMatch(combos, maskHi, maskLo, &match, &matchLo);
-  LinesFilt(combos, match);
+  intmax_t* match = 0;
+  (void)BufReserveZero(&match, ArrayBitElements(match, BufLen(l->lineHi)));
+  BufEachi(l->lineHi, i) {
+    if (LineMatches(l, i, maskHi, maskLo)) {
+      ArrayBitSet(match, i);
+    }
+  }
+  LinesFilt(l, match);
+  BufFree(&match);
 
-  intmax_t numPrimes = LinesNumPrimes(combos);
+  intmax_t numPrimes = LinesNumPrimes(l);
 
-  // convert "one in" to probability (onein = 1/onein)
-  BufEach(float, combos->onein, x) {
+  BufEach(float, l->onein, x) {
     *x = 1 / *x;
   }
 
@@ -542,19 +1195,25 @@ int WantEval(int category, int cube, Lines* combos, Want const* wantBuf) {
   float otherLinesChance = 0;
   if (numPrimes >= 2) {
     // only if there's at least 1 line other than the ANY prime line
-    BufOpRange(+, combos->onein, 0, numPrimes - 2, &otherLinesChance);
+    BufOpRange(+, l->onein, 0, numPrimes - 2, &otherLinesChance);
   }
-  combos->onein[numPrimes - 1] = 1 - otherLinesChance;
+  l->onein[numPrimes - 1] = 1 - otherLinesChance;
 
   // calculate non-prime ANY line chance
   otherLinesChance = 0;
-  if (BufLen(combos->onein) - numPrimes >= 2) {
+  if (BufLen(l->onein) - numPrimes >= 2) {
     // only if there's at least 1 line other than the ANY non prime line
-    BufOpRange(+, combos->onein, numPrimes, -2, &otherLinesChance);
+    BufOpRange(+, l->onein, numPrimes, -2, &otherLinesChance);
   }
-  BufAt(combos->onein, -1) = 1 - otherLinesChance;
+  BufAt(l->onein, -1) = 1 - otherLinesChance;
 
-  // generate combinations (array of indices)
+  return numPrimes;
+}
+
+// returns a Buf of line index ranges for each slot of the combo (min, max inclusive), same
+// format as the ranges passed to BufCombos
+static
+intmax_t* CubeRanges(int cube, Lines const* l, intmax_t numPrimes) {
 
 #define P 0, -2
 #define N 0, -1
@@ -596,163 +1255,250 @@ int WantEval(int category, int cube, Lines* combos, Want const* wantBuf) {
       // non-primes start
       *x = numPrimes;
     } else {
-      *x = BufI(combos->lineHi, *x);
+      *x = BufI(l->lineHi, *x);
     }
   }
 
-  // convert list of lines to flattened array of all possible line combinations
-  combos->comboSize = BufLen(ranges) / 2;
-  intmax_t* tmpIntMax = BufCombos(ranges, combos->comboSize);
-  LinesIndex(combos, tmpIntMax);
-  BufFree(&ranges);
+  return ranges;
+}
 
-  // filter out impossible combos
+//
+// SIMD kernels
+//
+// KernelGE(col, n, threshold) returns a bitmask where bit j is set if col[j] >= threshold.
+// n must be <= 64 and col must be readable up to n rounded up to a multiple of 8.
+// the best implementation for the cpu is picked at runtime by KernelInit
+//
 
-  static const BufH(Want, forbiddenCombos,
-    WantStat(DECENTS, 0), // 2+ lines of any decent impossible
-    WantStat(INVIN, 0),   // 2+ lines of invincibility impossible
-    WantStat(LINES, 2),
+typedef uint64_t KernelGEFunc(int const* col, size_t n, int threshold);
 
-    // same as above but 3+ lines
-    WantStat(BOSS, 0),
-    WantStat(IED, 0),
-    WantStat(DROP, 0),
-    WantStat(LINES, 3),
-  );
+static
+uint64_t KernelGEScalar(int const* col, size_t n, int threshold) {
+  uint64_t res = 0;
+  RangeBefore(n, j) {
+    res |= (uint64_t)(col[j] >= threshold) << j;
+  }
+  return res;
+}
 
-  // tmpIntMax stores the final mask
-  BufClear(tmpIntMax);
-  (void)BufReserve(&tmpIntMax, ArrayBitElements(tmpIntMax, BufLen(combos->lineHi)));
-  BufZero(tmpIntMax);
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__TINYC__)
+#define KERNEL_X86
+#include <immintrin.h>
 
-  Want const* lastLines = forbiddenCombos.data;
+__attribute__((target("sse2")))
+static
+uint64_t KernelGESSE2(int const* col, size_t n, int threshold) {
+  __m128i t = _mm_set1_epi32(threshold - 1);
+  uint64_t res = 0;
+  for (size_t j = 0; j < n; j += 4) {
+    __m128i v = _mm_loadu_si128((__m128i const*)(col + j));
+    uint64_t m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, t)));
+    res |= m << j;
+  }
+  return n < 64 ? res & (((uint64_t)1 << n) - 1) : res;
+}
 
-  BufEach(Want const, forbiddenCombos.data, w) {
-    switch (w->type) {
-      case WANT_STAT:
-        if ((w->lineHi & LINES_HI) || (w->lineLo & LINES_LO)) {
-          for (Want const* s = lastLines; s != w; ++s) {
-            LinesAnyNCombo(combos, w->value, s->lineHi, s->lineLo, &match, &matchLo, &counts);
-            BufOR(tmpIntMax, match);
-          }
-          lastLines = w;
-        }
-        break;
+__attribute__((target("avx2")))
+static
+uint64_t KernelGEAVX2(int const* col, size_t n, int threshold) {
+  __m256i t = _mm256_set1_epi32(threshold - 1);
+  uint64_t res = 0;
+  for (size_t j = 0; j < n; j += 8) {
+    __m256i v = _mm256_loadu_si256((__m256i const*)(col + j));
+    uint64_t m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, t)));
+    res |= m << j;
+  }
+  return n < 64 ? res & (((uint64_t)1 << n) - 1) : res;
+}
+#elif defined(__wasm_simd128__)
+#define KERNEL_WASM
+#include <wasm_simd128.h>
 
-      default:
-        fprintf(stderr, "unexpected %s in forbidden lines buf\n", WantTypeNames[w->type]);
-        goto cleanup;
-    }
+static
+uint64_t KernelGEWasm(int const* col, size_t n, int threshold) {
+  v128_t t = wasm_i32x4_splat(threshold);
+  uint64_t res = 0;
+  for (size_t j = 0; j < n; j += 4) {
+    v128_t v = wasm_v128_load(col + j);
+    uint64_t m = wasm_i32x4_bitmask(wasm_i32x4_ge(v, t));
+    res |= m << j;
   }
+  return n < 64 ? res & (((uint64_t)1 << n) - 1) : res;
+}
+#endif
 
-  BufNOT(tmpIntMax);
-  LinesFilt(combos, tmpIntMax);
+static KernelGEFunc* KernelGE = KernelGEScalar;
 
-  BufEach(Want const, wantBuf, w) {
-    switch (w->type) {
-      case WANT_STAT:
-        *BufAlloc(&stack) = *w;
-        break;
-      case WANT_OP: {
-        intmax_t* result = 0;
-        int opCount = w->opCount >= 0 ? w->opCount : BufLen(stack);
+static
+void KernelInit() {
+#if defined(KERNEL_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    KernelGE = KernelGEAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    KernelGE = KernelGESSE2;
+  }
+#elif defined(KERNEL_WASM)
+  KernelGE = KernelGEWasm;
+#endif
+}
 
-        // check if we're looking for "any combination of N lines". also check for masks since
-        // this operation can only work on stats
-        int numLines = 0;
-        size_t masks = 0;
-        maskHi = maskLo = 0;
-        BufEachRange(Want, stack, -opCount, -1, s) {
-          switch (s->type) {
-            case WANT_STAT:
-              if ((s->lineHi & LINES_HI) || (s->lineLo & LINES_LO)) {
-                numLines = s->value;
-              } else {
-                // create a mask of all the stats, minus LINES (only used by "any combination")
-                maskHi |= s->lineHi;
-                maskLo |= s->lineLo;
-              }
-              break;
-            case WANT_MASK:
-              ++masks;
-              break;
-            default:
-              break;
-          }
-        }
+// column j of a slot-major table of per-line values, padded so kernels can read whole vectors
+#define KERNEL_PAD(n) (((n) + 7) & ~(size_t)7)
 
-        if (numLines) {
-          // any N lines combination with ANY of these lines
-          if (masks) {
-            fprintf(stderr, "got LINES=%d with %d operands but there are %zu masks on the stack",
-              numLines, opCount, masks);
-            goto cleanup;
-          }
+// an accumulator sums up the values of the lines of a combo that match the mask, or counts them
+// if count is set. the combo passes a threshold if the accumulated value is >= value.
+// for the accumulators of a WantProg, value is the highest threshold tested on it
+typedef struct _WantAcc {
+  int lineHi, lineLo;
+  int count;
+  int value;
+} WantAcc;
 
-          LinesAnyNCombo(combos, numLines, maskHi, maskLo, &match, &matchLo, &counts);
-          result = BufDup(match);
-        }
+// acc >= value
+typedef struct _WantTest {
+  int acc;
+  int value;
+} WantTest;
 
-        // regular operator, mask lines for every stat/mask on the stack
-        else BufEachRange(Want, stack, -opCount, -1, s) {
-          switch (s->type) {
-            case WANT_STAT: {
-              // make a mask of lines that match the stat
-              LinesMatch(combos, s->lineHi, s->lineLo, &match, &matchLo);
-
-              // multiply all the values by the mask (non matching values will be 0)
-              int* relevantValues = BufDup(combos->value);
-              BufEachi(relevantValues, i) {
-                relevantValues[i] *= ArrayBitVal(match, i);
-              }
+typedef struct _WantNode {
+  int test;       // leaves: index into tests. -1 for operators
+  int op;         // operators: WANT_AND or WANT_OR
+  int first, num; // operators: range of the children indices
+} WantNode;
 
-              // sum every N elements (repeat sum N times in the array to match size)
-              BufEachi(relevantValues, i) {
-                int sum = 0;
-                BufOpRange(+, relevantValues, i, i + combos->comboSize - 1, &sum);
-                RangeBefore(combos->comboSize, j) {
-                  relevantValues[i + j] = sum;
-                }
-                i += combos->comboSize - 1;
-              }
+// wantBuf compiled to an expression tree. every distinct stat mask is accumulated and every
+// distinct threshold is tested only once no matter how many times it appears in the want
+typedef struct _WantProg {
+  WantAcc* accs;
+  WantTest* tests;
+  WantNode* nodes; // children always come before their parent. the last node is the root
+  int* children;   // indices into nodes
+} WantProg;
+
+static
+void WantProgFree(WantProg* p) {
+  BufFree(&p->accs);
+  BufFree(&p->tests);
+  BufFree(&p->nodes);
+  BufFree(&p->children);
+}
 
-              // make mask of elements in this sum array that are >= desired value
-              BufClear(match);
-              BufMask(int, relevantValues, *x >= s->value, &match);
-              BufFree(&relevantValues);
+// find or add a leaf node that tests acc(mask) >= value. returns the node index
+static
+int WantProgLeaf(WantProg* p, int lineHi, int lineLo, int count, int value) {
+  int acc, test;
+  for (acc = 0; acc < (int)BufLen(p->accs); ++acc) {
+    WantAcc const* a = &p->accs[acc];
+    if (a->lineHi == lineHi && a->lineLo == lineLo && a->count == count) {
+      break;
+    }
+  }
+  if (acc >= (int)BufLen(p->accs)) {
+    *BufAlloc(&p->accs) = (WantAcc){
+      .lineHi = lineHi,
+      .lineLo = lineLo,
+      .count = count,
+      .value = value,
+    };
+  }
+  p->accs[acc].value = Max(p->accs[acc].value, value);
+
+  for (test = 0; test < (int)BufLen(p->tests); ++test) {
+    if (p->tests[test].acc == acc && p->tests[test].value == value) {
+      break;
+    }
+  }
+  if (test >= (int)BufLen(p->tests)) {
+    *BufAlloc(&p->tests) = (WantTest){ .acc = acc, .value = value };
+  }
 
-              // remember to copy match as it gets reused
-              s->type = WANT_MASK;
-              s->mask = BufDup(match);
+  BufEachi(p->nodes, i) {
+    if (p->nodes[i].test == test) {
+      return i;
+    }
+  }
+  *BufAlloc(&p->nodes) = (WantNode){ .test = test };
+  return BufLen(p->nodes) - 1;
+}
 
-              // fall through to the MASK case
-            }
-            case WANT_MASK:
-              if (!result) {
-                result = s->mask;
-                s->mask = 0; // prevent result from being freed
-                break;
-              }
-#define c(x) case WANT_##x: Buf##x(result, s->mask); break
-              switch (w->op) {
-                c(AND);
-                c(OR);
-                default:
-                  fprintf(stderr, "unsupported operator %s\n", WantOpNames[w->op]);
-                  goto cleanup;
+// validate wantBuf and compile it to *prog
+static
+int WantCompile(Want const* wantBuf, WantProg* prog) {
+  int res = 0;
+  intmax_t* stack = 0; // indices into wantBuf
+  intmax_t* nodeOf = 0; // node index for each operator in wantBuf
+
+  WantProgFree(prog);
+  (void)BufReserve(&nodeOf, BufLen(wantBuf));
+  BufEachi(wantBuf, i) {
+    Want const* w = &wantBuf[i];
+    switch (w->type) {
+      case WANT_STAT:
+        *BufAlloc(&stack) = i;
+        break;
+      case WANT_OP: {
+        int opCount = w->opCount >= 0 ? w->opCount : (int)BufLen(stack);
+        if (opCount <= 0 || opCount > (int)BufLen(stack)) {
+          fprintf(stderr, "%s with %d operands but there are %zu values on the stack\n",
+            WantOpNames[w->op], opCount, BufLen(stack));
+          goto cleanup;
+        }
+
+        // check if we're looking for "any combination of N lines". also check for operator
+        // results since this operation can only work on stats
+        int numLines = 0;
+        int lineHi = 0, lineLo = 0;
+        size_t masks = 0;
+        BufEachRange(intmax_t, stack, -opCount, -1, j) {
+          Want const* s = &wantBuf[*j];
+          switch (s->type) {
+            case WANT_STAT:
+              if ((s->lineHi & LINES_HI) || (s->lineLo & LINES_LO)) {
+                numLines = s->value;
+              } else {
+                // create a mask of all the stats, minus LINES (only used by "any combination")
+                lineHi |= s->lineHi;
+                lineLo |= s->lineLo;
               }
-#undef c
               break;
             default:
-              fprintf(stderr, "unsupported operand %s\n", WantTypeNames[s->type]);
-              goto cleanup;
+              ++masks;
+              break;
+          }
+        }
+
+        if (numLines) {
+          if (masks) {
+            fprintf(stderr, "got LINES=%d with %d operands but there are %zu masks on the stack",
+              numLines, opCount, masks);
+            goto cleanup;
+          }
+          // the operands are only used to build the mask, they don't accumulate anything
+          nodeOf[i] = WantProgLeaf(prog, lineHi, lineLo, 1, numLines);
+        } else {
+          if (opCount > 1 && w->op != WANT_AND && w->op != WANT_OR) {
+            fprintf(stderr, "unsupported operator %s\n", WantOpNames[w->op]);
+            goto cleanup;
+          }
+          int first = BufLen(prog->children);
+          BufEachRange(intmax_t, stack, -opCount, -1, j) {
+            Want const* s = &wantBuf[*j];
+            *BufAlloc(&prog->children) = s->type == WANT_STAT
+              ? WantProgLeaf(prog, s->lineHi, s->lineLo, 0, s->value)
+              : nodeOf[*j];
           }
+          *BufAlloc(&prog->nodes) = (WantNode){
+            .test = -1,
+            .op = w->op == WANT_AND ? WANT_AND : WANT_OR,
+            .first = first,
+            .num = opCount,
+          };
+          nodeOf[i] = BufLen(prog->nodes) - 1;
         }
-        WantStackPop(stack, opCount);
-        *BufAlloc(&stack) = (Want){
-          .type = WANT_MASK,
-          .mask = result,
-        };
+
+        BufHdr(stack)->len -= opCount;
+        *BufAlloc(&stack) = i;
         break;
       }
       default:
@@ -761,190 +1507,4266 @@ int WantEval(int category, int cube, Lines* combos, Want const* wantBuf) {
     }
   }
 
-  if (BufLen(stack) > 1) {
+  if (BufLen(stack) != 1) {
     fprintf(stderr, "%zu values on the stack, expected 1\n", BufLen(stack));
 #ifdef CUBECALC_DEBUG
     puts("");
     puts("# final stack");
-    WantPrint(stack);
+    Want* tmp = 0;
+    BufEach(intmax_t, stack, j) {
+      *BufAlloc(&tmp) = wantBuf[*j];
+    }
+    WantPrint(tmp);
+    BufFree(&tmp);
     puts("");
 #endif
     goto cleanup;
   }
 
-  int typ = stack[0].type;
-  if (typ != WANT_MASK) {
-    fprintf(stderr, "expected WANT_MASK result, got %s\n", WantTypeNames[typ]);
+  int typ = wantBuf[stack[0]].type;
+  if (typ != WANT_OP) {
+    fprintf(stderr, "expected WANT_OP result, got %s\n", WantTypeNames[typ]);
     goto cleanup;
   }
 
-  if (!stack[0].mask) {
-    fprintf(stderr, "NULL line filter mask\n");
-    goto cleanup;
+  // a lone count operator is a leaf that might have been deduplicated, make sure it's the root
+  int root = nodeOf[stack[0]];
+  if (root != (int)BufLen(prog->nodes) - 1) {
+    *BufAlloc(&prog->children) = root;
+    *BufAlloc(&prog->nodes) = (WantNode){
+      .test = -1,
+      .op = WANT_AND,
+      .first = BufLen(prog->children) - 1,
+      .num = 1,
+    };
   }
 
   res = 1;
 
-  LinesFilt(combos, stack[0].mask);
-
 cleanup:
-  BufFree(&tmpIntMax);
-  BufFree(&match);
-  BufFree(&matchLo);
-  BufFree(&counts);
-  WantStackFree(&stack);
+  BufFree(&stack);
+  BufFree(&nodeOf);
+  if (!res) {
+    WantProgFree(prog);
+  }
   return res;
 }
 
+// copy the nodes of src into dst, sharing the accumulators and tests they have in common.
+// returns the index of src's root in dst
+static
+int WantProgMerge(WantProg* dst, WantProg const* src) {
+  int* nodeOf = 0;
+  (void)BufReserve(&nodeOf, BufLen(src->nodes));
+  BufEachi(src->nodes, i) {
+    WantNode const* n = &src->nodes[i];
+    if (n->test >= 0) {
+      WantTest const* t = &src->tests[n->test];
+      WantAcc const* a = &src->accs[t->acc];
+      nodeOf[i] = WantProgLeaf(dst, a->lineHi, a->lineLo, a->count, t->value);
+    } else {
+      int first = BufLen(dst->children);
+      RangeBefore(n->num, j) {
+        *BufAlloc(&dst->children) = nodeOf[src->children[n->first + j]];
+      }
+      *BufAlloc(&dst->nodes) = (WantNode){
+        .test = -1,
+        .op = n->op,
+        .first = first,
+        .num = n->num,
+      };
+      nodeOf[i] = BufLen(dst->nodes) - 1;
+    }
+  }
+  int root = BufAt(nodeOf, -1);
+  BufFree(&nodeOf);
+  return root;
+}
 
-float CubeCalc(
-  Want const* wantBuf,
-  Category category,
-  Cube cube,
-  Tier tier,
-  int lvl,
-  Region region,
-  Lines* outCombos
-) {
-  float res = 0;
-
-#ifdef CUBECALC_DEBUG
-  puts("");
-  puts("# want");
-  WantPrint(wantBuf);
-#endif
+// up to 64 combos that only differ by the last line, one per bit. the tests are computed
+// lazily with the simd kernels and cached for the duration of the lanes
+typedef struct _WantLanes {
+  int const* prefix; // accumulated value of each acc for the lines before the last
+  int const* cols;   // what the last line adds to each acc, one column of stride ints per acc
+  size_t stride;
+  size_t j0, n;      // range of lines within the columns
+  uint64_t* bits;    // result of each test
+  uint64_t* done;    // bitmask of the tests that have been computed
+} WantLanes;
 
-  Lines combos = {0};
-  LineData const* dataPrime = DataFind(category, cube, tier);
-  if (!dataPrime) {
-    fprintf(stderr, "prime line data not found\n");
-    goto cleanup;
+static
+uint64_t WantLanesTest(WantProg const* p, WantLanes* lanes, int i) {
+  if (!ArrayBit(lanes->done, i)) {
+    WantTest const* t = &p->tests[i];
+    int const* col = &lanes->cols[t->acc * lanes->stride + lanes->j0];
+    lanes->bits[i] = KernelGE(col, lanes->n, t->value - lanes->prefix[t->acc]);
+    ArrayBitSet(lanes->done, i);
   }
+  return lanes->bits[i];
+}
 
-  LineData const* dataNonPrime = DataFind(category, cube, tier - 1);
-  if (!dataNonPrime) {
-    fprintf(stderr, "non-prime line data not found\n");
-    goto cleanup;
+// evaluate node for the lanes in live. returns the mask of matching lanes.
+// operators stop evaluating their operands as soon as the result can't change anymore
+static
+uint64_t WantProgEval(WantProg const* p, WantLanes* lanes, int node, uint64_t live) {
+  WantNode const* n = &p->nodes[node];
+  if (n->test >= 0) {
+    return WantLanesTest(p, lanes, n->test) & live;
+  }
+  int const* c = &p->children[n->first];
+  uint64_t r;
+  if (n->op == WANT_AND) {
+    r = live;
+    for (int j = 0; j < n->num && r; ++j) {
+      r = WantProgEval(p, lanes, c[j], r);
+    }
+  } else {
+    r = 0;
+    for (int j = 0; j < n->num && r != live; ++j) {
+      r |= WantProgEval(p, lanes, c[j], live & ~r);
+    }
   }
+  return r;
+}
 
-  size_t group = ValueGroupFind(cube, category, region, lvl);
-  if (group >= valueGroupsLen || !valueGroups[group]) {
-    fprintf(stderr, "failed to find value group\n");
+//
+// WantOptimize
+//
+
+#define OPT_FALSE -1
+#define OPT_TRUE -2
+
+// WantProg node rebuilt as a tree we can rewrite. kind is WANT_STAT for leaves, WANT_OP for
+// operators or OPT_TRUE/OPT_FALSE for constants. leaves test acc(mask) >= value
+typedef struct _WantOptNode {
+  int kind;
+  int op;
+  int lineHi, lineLo;
+  int count;
+  int value;
+  int* children; // indices into the node array
+} WantOptNode;
+
+static
+int WantOptCmp(WantOptNode const* nodes, int a, int b) {
+  WantOptNode const* x = &nodes[a];
+  WantOptNode const* y = &nodes[b];
+#define cmp(f) if (x->f != y->f) return x->f < y->f ? -1 : 1
+  cmp(kind);
+  if (x->kind == WANT_STAT) {
+    cmp(lineHi);
+    cmp(lineLo);
+    cmp(count);
+    cmp(value);
     return 0;
   }
-
-  if (!LinesInit(&combos, dataPrime, dataNonPrime, group, tier)) {
-    goto cleanup;
+  cmp(op);
+#undef cmp
+  size_t n = Min(BufLen(x->children), BufLen(y->children));
+  RangeBefore(n, i) {
+    int c = WantOptCmp(nodes, x->children[i], y->children[i]);
+    if (c) {
+      return c;
+    }
   }
+  return (BufLen(x->children) > n) - (BufLen(y->children) > n);
+}
 
-#ifdef CUBECALC_DEBUG
-  size_t numPrimes = LinesNumPrimes(&combos);
-  puts("");
-  puts("# prime");
-  DataPrint(dataPrime, tier, combos.value);
-  puts("");
-  puts("# nonprime");
-  DataPrint(dataNonPrime, tier - 1, combos.value + numPrimes);
-#endif
+static
+int WantOptConst(WantOptNode** pnodes, int value) {
+  *BufAlloc(pnodes) = (WantOptNode){ .kind = value ? OPT_TRUE : OPT_FALSE };
+  return BufLen(*pnodes) - 1;
+}
 
-  if (!WantEval(category, cube, &combos, wantBuf)) {
-    goto cleanup;
+// rebuild node from prog as a canonical tree. returns the index of the new node in *pnodes.
+// maxReach is the highest value each accumulator can reach
+static
+int WantOptNodeFrom(WantProg const* prog, int node, int const* maxReach, WantOptNode** pnodes) {
+  WantNode const* n = &prog->nodes[node];
+
+  if (n->test >= 0) {
+    WantTest const* t = &prog->tests[n->test];
+    WantAcc const* a = &prog->accs[t->acc];
+    if (t->value <= 0 || t->value > maxReach[t->acc]) {
+      return WantOptConst(pnodes, t->value <= 0);
+    }
+    *BufAlloc(pnodes) = (WantOptNode){
+      .kind = WANT_STAT,
+      .lineHi = a->lineHi,
+      .lineLo = a->lineLo,
+      .count = a->count,
+      .value = t->value,
+    };
+    return BufLen(*pnodes) - 1;
   }
 
-  float const* primeChanceData;
-  Container* primeChance = MapGet(primeChances, cube);
-  switch (primeChance->type) {
-    case CONTAINER_BUF: {
-      primeChanceData = primeChance->data;
-      break;
+  // AND: true operands do nothing, a false operand makes everything false. OR is the opposite
+  int isAnd = n->op == WANT_AND;
+  int* children = 0;
+  RangeBefore(n->num, j) {
+    int c = WantOptNodeFrom(prog, prog->children[n->first + j], maxReach, pnodes);
+    WantOptNode* cn = &(*pnodes)[c];
+    if (cn->kind == (isAnd ? OPT_TRUE : OPT_FALSE)) {
+      continue;
     }
-    case CONTAINER_MAP: {
-      primeChanceData = MapGet(primeChance->data, tier);
-      break;
+    if (cn->kind == (isAnd ? OPT_FALSE : OPT_TRUE)) {
+      BufFree(&children);
+      return c;
+    }
+    if (cn->kind == WANT_OP && cn->op == n->op) {
+      // (a and b) and c = a and b and c
+      BufCat(&children, cn->children);
+    } else {
+      *BufAlloc(&children) = c;
     }
-    default:
-      fprintf(stderr, "invalid prime chance container %d\n", primeChance->type);
-      goto cleanup;
   }
 
-  {
-    size_t len = BufLen(primeChanceData);
-    if (len != combos.comboSize) {
-      fprintf(stderr, "expected %zu prime chances, got %zu\n", combos.comboSize, len);
-      goto cleanup;
+  // sort the operands and remove duplicates and thresholds implied by other thresholds on
+  // the same accumulator. for AND only the highest one matters, for OR only the lowest.
+  // the sort puts thresholds on the same accumulator next to each other, lowest first
+  WantOptNode const* nodes = *pnodes;
+  RangeFromBefore(1, BufLen(children), i) {
+    for (size_t j = i; j > 0 && WantOptCmp(nodes, children[j - 1], children[j]) > 0; --j) {
+      int tmp = children[j];
+      children[j] = children[j - 1];
+      children[j - 1] = tmp;
+    }
+  }
+  size_t len = 0;
+  BufEach(int, children, c) {
+    if (len) {
+      WantOptNode const* prev = &nodes[children[len - 1]];
+      WantOptNode const* cur = &nodes[*c];
+      if (!WantOptCmp(nodes, children[len - 1], *c)) {
+        continue;
+      }
+      if (prev->kind == WANT_STAT && cur->kind == WANT_STAT && prev->lineHi == cur->lineHi &&
+          prev->lineLo == cur->lineLo && prev->count == cur->count)
+      {
+        if (isAnd) {
+          children[len - 1] = *c;
+        }
+        continue;
+      }
     }
+    children[len++] = *c;
+  }
+  if (children) {
+    BufHdr(children)->len = len;
   }
 
-  // multiply line probabilities by prime chance
-  // to make it branchless, we prepend the non-prime chances and then we mul the index by prime bit
-  // example:
-  //   multipliers = [1 - primeChance1, 1 - primeChance2, 1 - primeChance3,
-  //                      primeChance1,     primeChance2,     primeChance3]
-  //   index = (line % 3) + IsPrime * 3
+  if (len == 0) {
+    BufFree(&children);
+    return WantOptConst(pnodes, isAnd);
+  }
+  if (len == 1) {
+    int c = children[0];
+    BufFree(&children);
+    return c;
+  }
 
-  float* primeChanceBuf = 0;
+  *BufAlloc(pnodes) = (WantOptNode){
+    .kind = WANT_OP,
+    .op = n->op,
+    .children = children,
+  };
+  return BufLen(*pnodes) - 1;
+}
+
+static
+void WantOptEmit(WantOptNode const* nodes, int node, Want** pout) {
+  WantOptNode const* n = &nodes[node];
+  if (n->kind == WANT_OP) {
+    BufEach(int const, n->children, c) {
+      WantOptEmit(nodes, *c, pout);
+    }
+    *BufAlloc(pout) = (Want){
+      .type = WANT_OP,
+      .op = n->op,
+      .opCount = BufLen(n->children),
+    };
+  } else if (n->count) {
+    *BufAlloc(pout) = (Want){ .type = WANT_STAT, .lineHi = n->lineHi, .lineLo = n->lineLo };
+    *BufAlloc(pout) = WantStat(LINES, n->value);
+    *BufAlloc(pout) = WantOp(AND, 2);
+  } else {
+    *BufAlloc(pout) = (Want){
+      .type = WANT_STAT,
+      .lineHi = n->lineHi,
+      .lineLo = n->lineLo,
+      .value = n->value,
+    };
+  }
+}
+
+int WantOptimize(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, Want** pout)
+{
+  int res = 0;
+  WantProg prog = {0};
+  WantOptNode* nodes = 0;
+  Lines lines = {0};
+  intmax_t* ranges = 0;
+  int* maxReach = 0;
+  LineData const* data[2];
+
+  BufClear(*pout);
 
+  if (!WantCompile(wantBuf, &prog) ||
+      !CubeLinesInit(ctx, &lines, category, cube, tier,
+        ValueGroupFind(ctx, cube, category, region, lvl), data))
   {
-    float* primeMul = 0;
-    (void)BufReserve(&primeMul, combos.comboSize * 2);
-    RangeBefore(combos.comboSize, i) {
-      primeMul[i] = 1 - primeChanceData[i];
-      primeMul[i + combos.comboSize] = primeChanceData[i];
+    goto cleanup;
+  }
+
+  // highest value each accumulator can reach: the best matching line for every slot.
+  // this ignores the forbidden line rules so it's an upper bound
+  ranges = CubeRanges(cube, &lines, LinesNumPrimes(&lines));
+  (void)BufReserveZero(&maxReach, BufLen(prog.accs));
+  BufEachi(prog.accs, k) {
+    WantAcc const* a = &prog.accs[k];
+    RangeBefore(BufLen(ranges) / 2, slot) {
+      int best = 0;
+      Range(ranges[slot * 2], ranges[slot * 2 + 1], i) {
+        if (LineMatches(&lines, i, a->lineHi, a->lineLo)) {
+          best = Max(best, a->count ? 1 : lines.value[i]);
+        }
+      }
+      maxReach[k] += best;
     }
+  }
 
-    size_t numLines = BufLen(combos.lineHi);
-    (void)BufReserve(&primeChanceBuf, numLines);
-    RangeBefore(numLines, i) {
-      size_t idx = (i % combos.comboSize) + ArrayBitVal(combos.prime, i) * combos.comboSize;
-      primeChanceBuf[i] = primeMul[idx];
+  int root = WantOptNodeFrom(&prog, BufLen(prog.nodes) - 1, maxReach, &nodes);
+  WantOptNode const* n = &nodes[root];
+  if (n->kind != OPT_FALSE) {
+    int operands = 0;
+    if (n->kind != OPT_TRUE) {
+      WantOptEmit(nodes, root, pout);
+      ++operands;
+    }
+
+    // the stats mentioned decide which lines are folded into ANY and which line rules apply
+    // (see LinesPrepare), so the stats of the folded tests are kept as a test that always passes
+    int maskHi, maskLo, outHi, outLo;
+    WantMask(wantBuf, &maskHi, &maskLo);
+    WantMask(*pout, &outHi, &outLo);
+    maskHi &= ~(outHi | LINES_HI);
+    maskLo &= ~(outLo | LINES_LO);
+    if (maskHi || maskLo) {
+      *BufAlloc(pout) = (Want){ .type = WANT_STAT, .lineHi = maskHi, .lineLo = maskLo };
+      ++operands;
+    } else if (!operands) {
+      // every line is folded into ANY, so this sums up to the chance of rolling any combo
+      *BufAlloc(pout) = WantStat(ANY, 0);
+      ++operands;
     }
 
-    BufFree(&primeMul);
+    // a single stat still needs an operator
+    if (operands > 1 || n->kind == OPT_TRUE || (n->kind == WANT_STAT && !n->count)) {
+      *BufAlloc(pout) = WantOp(AND, operands);
+    }
   }
 
-  BufOp2(*, combos.onein, primeChanceBuf);
-  BufFree(&primeChanceBuf);
+  res = 1;
 
-#ifdef CUBECALC_DEBUG
-  puts("");
-  puts("# combos");
-#ifdef CUBECALC_PRINTCOMBOS
-  LinesPrint(&combos);
-#endif
-  printf("%zu total combos\n", BufLen(combos.lineHi) / combos.comboSize);
-#endif
+cleanup:
+  WantProgFree(&prog);
+  BufEach(WantOptNode, nodes, node) {
+    BufFree(&node->children);
+  }
+  BufFree(&nodes);
+  LinesFree(&lines);
+  BufFree(&ranges);
+  BufFree(&maxReach);
+  return res;
+}
 
-  // calculate combo probabilities
-  float* comboProbs = 0;
-  float multiplier = cube == UNI ? 1 / 3.0 : 1;
-  // ^ on unicubes, you spend an average of 3 cubes to select the line and roll it once
-  BufEach(float, combos.onein, x) {
-    float comboProb = 1;
-    OpRange(*, x, 0, combos.comboSize - 1, &comboProb);
-    *BufAlloc(&comboProbs) = comboProb * multiplier;
-    x += combos.comboSize - 1;
+#undef OPT_FALSE
+#undef OPT_TRUE
+
+uint64_t WantHash(Want const* wantBuf) {
+  uint64_t h = HASH_SEED;
+  BufEach(Want const, wantBuf, w) {
+    int fields[4] = { w->type };
+    if (w->type == WANT_OP) {
+      fields[1] = w->op;
+      fields[2] = w->opCount;
+    } else {
+      fields[1] = w->lineHi;
+      fields[2] = w->lineLo;
+      fields[3] = w->value;
+    }
+    h = HashBytes(fields, sizeof(fields), h);
   }
+  return h;
+}
 
-  // calculate probability to roll any of the combos
-  BufOp(+, comboProbs, &res);
-  BufFree(&comboProbs);
+// set the line dictionary of c to the lines of l, so line i of l is index i.
+// primeMul is the same as for WantEval
+static
+void CombosInit(Combos* c, Lines const* l, float const* primeMul, size_t comboSize) {
+  BufClear(c->lines);
+  BufEachi(l->lineHi, i) {
+    *BufAlloc(&c->lines) = (ComboLine){
+      .mask = LineMask(l->lineHi[i], l->lineLo[i]),
+      .prob = l->onein[i],
+      .value = l->value[i],
+      .prime = ArrayBitVal(l->prime, i),
+    };
+  }
+  BufClear(c->slotMul);
+  BufCat(&c->slotMul, primeMul);
+  c->comboSize = comboSize;
+}
 
-cleanup:
-  if (outCombos) {
-    *outCombos = combos;
-  } else {
-    LinesFree(&combos);
+// finds grouped combos by their lines, see CombosGroupAdd
+typedef struct _CombosGroupIndex {
+  HashIndex index; // hash of the lines -> group + 1
+} CombosGroupIndex;
+
+static
+void CombosGroupIndexFree(CombosGroupIndex* g) {
+  HashIndexFree(&g->index);
+}
+
+// add prob and perms to the group of lines (comboSize line indices in ascending order) in c,
+// creating it if it doesn't exist yet
+static
+void CombosGroupAdd(Combos* c, CombosGroupIndex* g, uint8_t const* lines, size_t comboSize,
+  double prob, size_t perms)
+{
+  uint64_t hash = HashBytes(lines, comboSize, HASH_SEED);
+  size_t cursor = 0;
+  for (uintptr_t v; (v = HashIndexNext(&g->index, hash, &cursor));) {
+    size_t i = v - 1;
+    if (!memcmp(&c->index[i * comboSize], lines, comboSize)) {
+      c->groupProb[i] += prob;
+      c->groupPerms[i] += perms;
+      return;
+    }
+  }
+  (void)HashIndexAdd(&g->index, hash, BufLen(c->groupProb) + 1);
+  RangeBefore(comboSize, j) {
+    *BufAlloc(&c->index) = lines[j];
   }
+  *BufAlloc(&c->groupProb) = prob;
+  *BufAlloc(&c->groupPerms) = perms;
+}
 
-  return res;
+// the line rules of the generated data. new restrictions only need a row here
+static const LineRule generatedLineRules[] = {
+  { _WantStatLine(DECENTS), .max = 1 },
+  { _WantStatLine(INVIN), .max = 1 },
+  { _WantStatLine(BOSS), .max = 2 },
+  { _WantStatLine(IED), .max = 2 },
+  { _WantStatLine(DROP), .max = 2 },
+};
+
+// WantEval tracks which rules each line counts towards as a bitmask
+#define FORBIDDEN_MAX 32
+
+// the region only changes the line rules. configurations and cached results are keyed by this
+// instead of the region so regions share them unless a rule is restricted to some regions
+static
+int CubeRuleRegion(CubeContext const* ctx, Region region) {
+  return ctx->ruleRegions ? (int)region : 0;
+}
+
+// build the rules for impossible combos on an item. each rule is an accumulator that counts
+// lines, combos where the count reaches value are impossible
+static
+int ForbiddenInit(CubeDataset const* d, WantAcc** pforbidden, Category category, Cube cube,
+  int region)
+{
+  BufClear(*pforbidden);
+  RangeBefore(d->lineRulesLen, i) {
+    LineRule const* r = &d->lineRules[i];
+    if ((r->cubes && !(r->cubes & cube)) ||
+        (r->categories && !(r->categories & category)) ||
+        (r->regions && !(r->regions & region)))
+    {
+      continue;
+    }
+    *BufAlloc(pforbidden) = (WantAcc){
+      .lineHi = r->lineHi,
+      .lineLo = r->lineLo,
+      .count = 1,
+      .value = r->max + 1,
+    };
+  }
+  if (BufLen(*pforbidden) > FORBIDDEN_MAX) {
+    fprintf(stderr, "too many line rules (%zu)\n", BufLen(*pforbidden));
+    return 0;
+  }
+  return 1;
 }
 
-void CubeGlobalInit() {
-  cubecalcGeneratedGlobalInit();
+void CubeSetParallelFor(CubeContext* ctx, CubeParallelForFunc* parallelFor) {
+  ctx->parallelFor = parallelFor;
+}
+
+// enumerate every combo of lines in ranges and sum the probability of the ones matching wantBuf.
+// combos are never materialized as a whole. instead, we walk them like an odometer (last slot
+// spins fastest, same order as BufCombos) and keep prefix products of the probabilities and
+// prefix sums of the accumulators for each slot.
+//
+// the last slot is evaluated 64 lines at a time: the per-line values for it are laid out as
+// one column per accumulator so the threshold checks can be done with the simd kernels
+// (see KernelGE) and the want is evaluated on bitmasks (see WantProgEval)
+//
+// the work is split in chunks by the line picked for the first slot. each chunk has its own
+// sum and the sums are added up in order at the end, so the result is the same whether the
+// chunks run in parallel or not
+//
+// several wants can be evaluated in the same pass by merging them into one prog (see
+// WantProgMerge). the tests they have in common are only computed once per 64 lanes
+//
+// wants only ever test acc >= value through AND/OR, so adding lines can only turn them true.
+// every time a line is picked, each want is checked against the best and the worst the
+// remaining slots can add. the subtree is skipped for wants that fail even in the best case and,
+// when no combo in it can be impossible, wants that pass even in the worst case get the mass of
+// the whole subtree at once without walking it. the subtree is skipped as soon as no want is
+// left undecided
+//
+// when the combos are not needed and primeMul is given, consecutive slots with the same range
+// (the N, N, ... slots) are walked as multisets instead: lines are picked in non-decreasing order
+// within such a run, since every ordering of the same lines matches the same wants. the orderings
+// only differ by which slot gets the prime chance of which line, so a multiset with m_j copies of
+// each line and p prime lines in a run of k slots weighs
+//
+//   prod(onein) * p! / prod(m_j! of primes) * (k - p)! / prod(m_j! of non-primes) * E_p
+//
+// where E_p is the chance that exactly the slots picked for the primes roll prime, summed over
+// every choice of p slots of the run. that's up to k! fewer combos to walk
+//
+// - slotProbs: probability of each line for each slot (comboSize rows of BufLen(lineHi))
+// - primeMul: chance of rolling non-prime (comboSize elements) then prime (comboSize elements)
+//             for each slot, the same factors slotProbs has baked in. can be NULL
+// - prog: see WantCompile
+// - roots: Buf of the root node of each want in prog. pres, out and pnumCombos have one
+//          element per root
+// - forbidden: see ForbiddenInit
+// - out: if non-NULL, the matching combos are appended to its index. line i of l is index i,
+//        see CombosInit
+// - grouped: out gets grouped combos instead, see Combos. this walks multisets like when out is
+//            NULL, so it's also much faster
+// - pnumCombos: incremented by the number of matching combos
+//
+
+// below this many combos (before filtering impossible ones) the chunks are ran serially
+#define WANT_EVAL_PARALLEL_MIN (1 << 16)
+
+// what each line adds to each of accs when it's picked (numAccs ints per line) and the
+// forbidden rules it counts towards (bit k is set for forbidden[k])
+static
+void WantContribInit(Lines const* l, WantAcc const* accs, WantAcc const* forbidden,
+  int** pcontrib, uint32_t** plineRules)
+{
+  size_t numAccs = BufLen(accs);
+  BufClear(*pcontrib);
+  BufClear(*plineRules);
+  (void)BufReserve(pcontrib, BufLen(l->lineHi) * numAccs);
+  (void)BufReserveZero(plineRules, BufLen(l->lineHi));
+  BufEachi(l->lineHi, i) {
+    BufEachi(accs, k) {
+      WantAcc const* a = &accs[k];
+      int match = LineMatches(l, i, a->lineHi, a->lineLo);
+      (*pcontrib)[i * numAccs + k] = match * (a->count ? 1 : l->value[i]);
+    }
+    BufEachi(forbidden, k) {
+      WantAcc const* a = &forbidden[k];
+      if (LineMatches(l, i, a->lineHi, a->lineLo)) {
+        (*plineRules)[i] |= (uint32_t)1 << k;
+      }
+    }
+  }
 }
 
-void CubeGlobalFree() {
-  cubecalcGeneratedGlobalFree();
+typedef struct _WantEvalData {
+  Lines const* l;
+  intmax_t const* ranges;
+  float const* slotProbs;
+  WantProg const* prog;
+  int const* roots;
+  WantAcc const* forbidden;
+
+  // multiset mode, see WantEval. runPos is the position of each slot in its run of slots with
+  // the same range. runWeight has comboSize + 1 elements for each slot, indexed by the number of
+  // primes, and is only set for the slots that end a run
+  int sym;
+  int* runPos;
+  double* runWeight;
+
+  // what each line adds to each accumulator when it's picked
+  int* contrib;
+  uint32_t* lineRules; // bit k is set if the line counts towards forbidden[k]
+
+  // same thing for the last slot but transposed, padded so the kernels can read whole vectors
+  int* colAcc;
+  uint64_t* ruleLanes; // for each rule, the lines of the last slot that count towards it, 64 per
+                       // element
+  size_t numBlocks;    // elements of ruleLanes per rule
+  size_t stride;
+
+  // for each slot, the most and least that slots from there to the last can add to each
+  // accumulator and the most they can add to each forbidden rule. restMass and restCount are
+  // the total probability and number of the combos of those slots
+  int* maxRest;
+  int* minRest;
+  int* maxRestForbidden;
+  double* restMass;
+  size_t* restCount;
+
+  // results for each chunk and root. when running serially, out is written to directly since
+  // the chunks run in order anyway. otherwise each chunk gets its own Lines in outs
+  double* sums;
+  size_t* numCombos;
+  Combos* out;
+  Combos* outs;
+  int grouped;
+  CombosGroupIndex* groups; // for each root of out when grouped
+
+  // chunks are the lines of the first slot, see WantEvalRun
+  size_t numChunks, nextChunk;
+  double totalCombos;
+} WantEvalData;
+
+static
+void WantEvalChunk(void* data, size_t chunk) {
+  WantEvalData const* e = data;
+  Lines const* l = e->l;
+  float const* slotProbs = e->slotProbs;
+  WantProg const* prog = e->prog;
+  WantAcc const* forbidden = e->forbidden;
+  int const* contrib = e->contrib;
+  uint32_t const* lineRules = e->lineRules;
+  size_t numRoots = BufLen(e->roots);
+  Combos* out = e->outs ? &e->outs[chunk * numRoots] : e->out;
+  double* sums = &e->sums[chunk * numRoots];
+  size_t* numCombos = &e->numCombos[chunk * numRoots];
+  CombosGroupIndex* groups = e->groups;
+
+  int* acc = 0;
+  int* counts = 0;
+  uint64_t* bits = 0;
+  uint64_t* done = 0;
+  intmax_t* idx = 0;
+  float* prob = 0;
+  int* live = 0;
+  size_t* numLive = 0;
+  int* bound = 0;
+  int* zeros = 0;
+  int* reps = 0;
+  int* primes = 0;
+  double* perms = 0;
+  uint32_t* fullRules = 0;
+  uint8_t* groupLines = 0;
+
+  size_t numLines = BufLen(l->lineHi);
+  size_t numAccs = BufLen(prog->accs);
+  size_t numForbidden = BufLen(forbidden);
+  size_t comboSize = BufLen(e->ranges) / 2;
+  size_t last = comboSize - 1;
+  intmax_t lastStart = e->ranges[last * 2];
+  size_t lastLen = Max(0, e->ranges[last * 2 + 1] - lastStart + 1);
+  size_t stride = e->stride;
+
+  // only pick the chunk's line for the first slot
+  intmax_t* ranges = BufDup((intmax_t*)e->ranges);
+  if (comboSize > 1) {
+    ranges[0] = ranges[1] = ranges[0] + chunk;
+  }
+
+  // prefix state for each slot. row d is the state after picking the lines for slots 0..d-1.
+  // row 0 is all zeros (nothing picked) so slot d reads from row d and writes to row d + 1
+  (void)BufReserveZero(&acc, comboSize * numAccs);
+  (void)BufReserveZero(&counts, comboSize * numForbidden);
+  (void)BufReserveZero(&fullRules, comboSize); // rules that can't take any more lines
+  (void)BufReserve(&prob, comboSize);
+  (void)BufReserve(&bits, BufLen(prog->tests));
+  (void)BufReserve(&done, ArrayBitElements(done, BufLen(prog->tests)));
+  (void)BufReserve(&idx, comboSize);
+  prob[0] = 1;
+
+  // lines of the current combo in ascending order, and the group index for chunks that have
+  // their own outs
+  if (out && e->grouped) {
+    (void)BufReserve(&groupLines, comboSize);
+    if (e->outs) {
+      groups = 0;
+      (void)BufReserveZero(&groups, numRoots);
+    }
+  }
+
+  // multiset mode: copies of the last picked line and primes picked so far in the current run,
+  // and number of orderings of the lines picked so far
+  (void)BufReserveZero(&reps, comboSize);
+  (void)BufReserveZero(&primes, comboSize);
+  (void)BufReserve(&perms, comboSize);
+  perms[0] = 1;
+  double const* runWeight = e->runWeight;
+
+  // roots that are still undecided for the current prefix, one row per slot like acc
+  (void)BufReserve(&live, comboSize * numRoots);
+  (void)BufReserve(&numLive, comboSize);
+  RangeBefore(numRoots, q) {
+    live[q] = q;
+  }
+  numLive[0] = numRoots;
+
+  // the bounds are evaluated as a single lane with nothing left to add
+  (void)BufReserve(&bound, numAccs);
+  (void)BufReserveZero(&zeros, numAccs * KERNEL_PAD(1));
+  WantLanes boundLanes = {
+    .prefix = bound,
+    .cols = zeros,
+    .stride = KERNEL_PAD(1),
+    .n = 1,
+    .bits = bits,
+    .done = done,
+  };
+
+  // sums are accumulated in double, summing up millions of tiny floats loses a lot of precision
+  intmax_t d = 0;
+  idx[0] = ranges[0] - 1;
+  while (d >= 0) {
+    if (d == (intmax_t)last) {
+      uint32_t full = fullRules[d];
+      float const* lastProbs = &slotProbs[d * numLines];
+      WantLanes lanes = {
+        .prefix = &acc[d * numAccs],
+        .cols = e->colAcc,
+        .stride = stride,
+        .bits = bits,
+        .done = done,
+      };
+      int pos = e->sym ? e->runPos[d] : 0;
+      size_t firstJ = pos ? idx[d - 1] - lastStart : 0;
+      for (size_t j0 = firstJ & ~(size_t)63; j0 < lastLen; j0 += 64) {
+        size_t n = Min(64, lastLen - j0);
+        uint64_t match = n < 64 ? ((uint64_t)1 << n) - 1 : ~(uint64_t)0;
+        if (j0 < firstJ) {
+          match &= ~(((uint64_t)1 << (firstJ - j0)) - 1);
+        }
+
+        // filter out impossible combos
+        for (size_t k = 0; full >> k; ++k) {
+          if (full & ((uint32_t)1 << k)) {
+            match &= ~e->ruleLanes[k * e->numBlocks + j0 / 64];
+          }
+        }
+        if (!match) {
+          continue;
+        }
+
+        lanes.j0 = j0;
+        lanes.n = n;
+        BufZero(done);
+        RangeBefore(numLive[d], r) {
+          int q = live[d * numRoots + r];
+          uint64_t m = WantProgEval(prog, &lanes, e->roots[q], match);
+          for (size_t j = j0; m; ++j, m >>= 1) {
+            if (!(m & 1)) {
+              continue;
+            }
+            intmax_t i = lastStart + j;
+            double p;
+            size_t numPerms;
+            if (e->sym) {
+              int rep = pos && i == idx[d - 1] ? reps[d] + 1 : 1;
+              int np = (pos ? primes[d] : 0) + ArrayBitVal(l->prime, i);
+              p = (double)prob[d] * l->onein[i] / rep * runWeight[d * (comboSize + 1) + np];
+              numPerms = perms[d] * (pos + 1) / rep;
+            } else {
+              p = prob[d] * lastProbs[i];
+              numPerms = 1;
+            }
+            sums[q] += p;
+            numCombos[q] += numPerms;
+            if (out && e->grouped) {
+              RangeBefore(comboSize, k) {
+                intmax_t x = k < d ? idx[k] : i;
+                size_t at = k;
+                for (; at && groupLines[at - 1] > x; --at) {
+                  groupLines[at] = groupLines[at - 1];
+                }
+                groupLines[at] = x;
+              }
+              CombosGroupAdd(&out[q], &groups[q], groupLines, comboSize, p, numPerms);
+            } else if (out) {
+              RangeBefore(d, k) {
+                *BufAlloc(&out[q].index) = idx[k];
+              }
+              *BufAlloc(&out[q].index) = i;
+            }
+          }
+        }
+      }
+      --d;
+      continue;
+    }
+
+    intmax_t i = ++idx[d];
+    if (i > ranges[d * 2 + 1]) {
+      --d;
+      continue;
+    }
+
+    if (e->sym) {
+      int pos = e->runPos[d];
+      reps[d + 1] = pos && i == idx[d - 1] ? reps[d] + 1 : 1;
+      primes[d + 1] = (pos ? primes[d] : 0) + ArrayBitVal(l->prime, i);
+      perms[d + 1] = perms[d] * (pos + 1) / reps[d + 1];
+      prob[d + 1] = prob[d] * l->onein[i] / reps[d + 1];
+      if (!e->runPos[d + 1]) {
+        prob[d + 1] *= runWeight[d * (comboSize + 1) + primes[d + 1]];
+      }
+    } else {
+      perms[d + 1] = 1;
+      prob[d + 1] = prob[d] * slotProbs[d * numLines + i];
+    }
+
+    // filter out impossible combos. this skips the entire subtree
+    uint32_t rules = lineRules[i];
+    if (rules & fullRules[d]) {
+      continue;
+    }
+    int* cnt = &counts[(d + 1) * numForbidden];
+    RangeBefore(numForbidden, k) {
+      cnt[k] = counts[d * numForbidden + k];
+    }
+    fullRules[d + 1] = fullRules[d];
+    for (size_t k = 0; rules >> k; ++k) {
+      if ((rules & ((uint32_t)1 << k)) && ++cnt[k] + 1 >= forbidden[k].value) {
+        fullRules[d + 1] |= (uint32_t)1 << k;
+      }
+    }
+
+    int* a = &acc[(d + 1) * numAccs];
+    RangeBefore(numAccs, k) {
+      a[k] = acc[d * numAccs + k] + contrib[i * numAccs + k];
+    }
+
+    // branch and bound, see WantEval
+    int const* maxRest = &e->maxRest[(d + 1) * numAccs];
+    int const* minRest = &e->minRest[(d + 1) * numAccs];
+    int const* rowLive = &live[d * numRoots];
+    int* nextLive = &live[(d + 1) * numRoots];
+    size_t numNext = 0;
+    RangeBefore(numAccs, k) {
+      bound[k] = a[k] + maxRest[k];
+    }
+    BufZero(done);
+    RangeBefore(numLive[d], r) {
+      if (WantProgEval(prog, &boundLanes, e->roots[rowLive[r]], 1)) {
+        nextLive[numNext++] = rowLive[r];
+      }
+    }
+
+    // in multiset mode the rest of the run only has the lines from i on, so the mass of the
+    // subtree is only known when the run ends here
+    int bulk = !out && numNext && !(e->sym && e->runPos[d + 1]);
+    RangeBefore(numForbidden, k) {
+      bulk &= cnt[k] + e->maxRestForbidden[(d + 1) * numForbidden + k] < forbidden[k].value;
+    }
+    if (bulk) {
+      RangeBefore(numAccs, k) {
+        bound[k] = a[k] + minRest[k];
+      }
+      BufZero(done);
+      size_t numUndecided = 0;
+      RangeBefore(numNext, r) {
+        int q = nextLive[r];
+        if (WantProgEval(prog, &boundLanes, e->roots[q], 1)) {
+          sums[q] += prob[d + 1] * e->restMass[d + 1];
+          numCombos[q] += perms[d + 1] * e->restCount[d + 1];
+        } else {
+          nextLive[numUndecided++] = q;
+        }
+      }
+      numNext = numUndecided;
+    }
+
+    if (!numNext) {
+      continue;
+    }
+    numLive[d + 1] = numNext;
+
+    ++d;
+    idx[d] = e->sym && e->runPos[d] ? idx[d - 1] - 1 : ranges[d * 2] - 1;
+  }
+
+  BufFree(&ranges);
+  BufFree(&acc);
+  BufFree(&counts);
+  BufFree(&bits);
+  BufFree(&done);
+  BufFree(&idx);
+  BufFree(&prob);
+  BufFree(&live);
+  BufFree(&numLive);
+  BufFree(&bound);
+  BufFree(&zeros);
+  BufFree(&reps);
+  BufFree(&primes);
+  BufFree(&perms);
+  BufFree(&fullRules);
+  BufFree(&groupLines);
+  if (groups != e->groups) {
+    BufEach(CombosGroupIndex, groups, g) {
+      CombosGroupIndexFree(g);
+    }
+    BufFree(&groups);
+  }
+}
+
+// set up e to run the chunks of WantEval. see WantEvalRun and WantEvalEnd
+static
+void WantEvalBegin(WantEvalData* e, Lines const* l, intmax_t const* ranges,
+  float const* slotProbs, float const* primeMul, WantProg const* prog, int const* roots,
+  WantAcc const* forbidden, Combos* out, int grouped)
+{
+  *e = (WantEvalData){
+    .l = l,
+    .ranges = ranges,
+    .slotProbs = slotProbs,
+    .prog = prog,
+    .roots = roots,
+    .forbidden = forbidden,
+    .out = out,
+    .grouped = out && grouped,
+  };
+
+  WantAcc const* accs = prog->accs;
+  size_t numLines = BufLen(l->lineHi);
+  size_t numAccs = BufLen(accs);
+  size_t numForbidden = BufLen(forbidden);
+  size_t comboSize = BufLen(ranges) / 2;
+
+  WantContribInit(l, accs, forbidden, &e->contrib, &e->lineRules);
+
+  size_t last = comboSize - 1;
+  intmax_t lastStart = ranges[last * 2];
+  size_t lastLen = Max(0, ranges[last * 2 + 1] - lastStart + 1);
+  e->stride = KERNEL_PAD(lastLen);
+  (void)BufReserveZero(&e->colAcc, numAccs * e->stride);
+  e->numBlocks = (lastLen + 63) / 64;
+  (void)BufReserveZero(&e->ruleLanes, numForbidden * e->numBlocks);
+  RangeBefore(lastLen, j) {
+    RangeBefore(numAccs, k) {
+      e->colAcc[k * e->stride + j] = e->contrib[(lastStart + j) * numAccs + k];
+    }
+    RangeBefore(numForbidden, k) {
+      if (e->lineRules[lastStart + j] & ((uint32_t)1 << k)) {
+        e->ruleLanes[k * e->numBlocks + j / 64] |= (uint64_t)1 << (j % 64);
+      }
+    }
+  }
+
+  (void)BufReserveZero(&e->maxRest, (comboSize + 1) * numAccs);
+  (void)BufReserveZero(&e->minRest, (comboSize + 1) * numAccs);
+  (void)BufReserveZero(&e->maxRestForbidden, (comboSize + 1) * numForbidden);
+  (void)BufReserve(&e->restMass, comboSize + 1);
+  (void)BufReserve(&e->restCount, comboSize + 1);
+  e->restMass[comboSize] = 1;
+  e->restCount[comboSize] = 1;
+  for (intmax_t j = comboSize - 1; j >= 0; --j) {
+    int* maxRest = &e->maxRest[j * numAccs];
+    int* minRest = &e->minRest[j * numAccs];
+    int* maxRestForbidden = &e->maxRestForbidden[j * numForbidden];
+    double mass = 0;
+    Range(ranges[j * 2], ranges[j * 2 + 1], i) {
+      mass += slotProbs[j * numLines + i];
+      RangeBefore(numAccs, k) {
+        int v = e->contrib[i * numAccs + k];
+        int first = i == ranges[j * 2];
+        maxRest[k] = first ? v : Max(maxRest[k], v);
+        minRest[k] = first ? v : Min(minRest[k], v);
+      }
+      RangeBefore(numForbidden, k) {
+        maxRestForbidden[k] |= (e->lineRules[i] >> k) & 1;
+      }
+    }
+    RangeBefore(numAccs, k) {
+      maxRest[k] += maxRest[numAccs + k];
+      minRest[k] += minRest[numAccs + k];
+    }
+    RangeBefore(numForbidden, k) {
+      maxRestForbidden[k] += maxRestForbidden[numForbidden + k];
+    }
+    e->restMass[j] = mass * e->restMass[j + 1];
+    e->restCount[j] = Max(0, ranges[j * 2 + 1] - ranges[j * 2] + 1) * e->restCount[j + 1];
+  }
+
+  e->sym = primeMul && (!out || e->grouped);
+  (void)BufReserveZero(&e->runPos, comboSize + 1);
+  (void)BufReserveZero(&e->runWeight, comboSize * (comboSize + 1));
+  if (e->sym) {
+    double* prev = 0;
+    double* cur = 0;
+    (void)BufReserve(&prev, comboSize + 1);
+    (void)BufReserve(&cur, comboSize + 1);
+    for (size_t j = 1; j < comboSize; ++j) {
+      if (ranges[j * 2] == ranges[j * 2 - 2] && ranges[j * 2 + 1] == ranges[j * 2 - 1]) {
+        e->runPos[j] = e->runPos[j - 1] + 1;
+      }
+    }
+    RangeBefore(comboSize, j) {
+      if (e->runPos[j + 1]) {
+        continue;
+      }
+      // E_p for the run ending at j, adding one slot at a time
+      int k = e->runPos[j] + 1;
+      BufZero(prev);
+      prev[0] = 1;
+      Range(j - k + 1, j, s) {
+        RangeBefore(k + 1, p) {
+          cur[p] = prev[p] * primeMul[s] + (p ? prev[p - 1] * primeMul[comboSize + s] : 0);
+        }
+        double* tmp = prev;
+        prev = cur;
+        cur = tmp;
+      }
+      double* w = &e->runWeight[j * (comboSize + 1)];
+      RangeBefore(k + 1, p) {
+        double f = prev[p];
+        Range(1, p, x) {
+          f *= x;
+        }
+        Range(1, k - p, x) {
+          f *= x;
+        }
+        w[p] = f;
+      }
+    }
+    BufFree(&prev);
+    BufFree(&cur);
+  }
+
+  e->numChunks = comboSize > 1 ? Max(0, ranges[1] - ranges[0] + 1) : 1;
+  e->totalCombos = 1;
+  RangeBefore(comboSize, j) {
+    e->totalCombos *= ranges[j * 2 + 1] - ranges[j * 2] + 1;
+  }
+
+  size_t numRoots = BufLen(roots);
+  (void)BufReserveZero(&e->sums, e->numChunks * numRoots);
+  (void)BufReserveZero(&e->numCombos, e->numChunks * numRoots);
+  if (e->grouped) {
+    (void)BufReserveZero(&e->groups, numRoots);
+  }
+}
+
+// run the chunks that are left, on parallelFor when it's worth it. with a deadline the
+// chunks run serially and this returns once CubeClockNs() reaches it, so the evaluation can be
+// spread over several calls. returns non-zero once every chunk has ran
+static
+int WantEvalRun(WantEvalData* e, CubeParallelForFunc* parallelFor, intmax_t const* deadline) {
+  size_t numRoots = BufLen(e->roots);
+  if (!deadline && !e->nextChunk && e->numChunks > 1 &&
+      e->totalCombos >= WANT_EVAL_PARALLEL_MIN && parallelFor)
+  {
+    if (e->out) {
+      (void)BufReserveZero(&e->outs, e->numChunks * numRoots);
+    }
+    parallelFor(WantEvalChunk, e, e->numChunks);
+    e->nextChunk = e->numChunks;
+  }
+  while (e->nextChunk < e->numChunks) {
+    WantEvalChunk(e, e->nextChunk++);
+    if (deadline && CubeClockNs() >= *deadline) {
+      break;
+    }
+  }
+  return e->nextChunk >= e->numChunks;
+}
+
+// add up the results of the chunks in order and free e
+static
+void WantEvalEnd(WantEvalData* e, float multiplier, float* pres, size_t* pnumCombos) {
+  Combos* out = e->out;
+  size_t comboSize = BufLen(e->ranges) / 2;
+  size_t numRoots = BufLen(e->roots);
+  size_t numChunks = e->numChunks;
+  RangeBefore(numRoots, q) {
+    double sum = 0;
+    RangeBefore(numChunks, i) {
+      sum += e->sums[i * numRoots + q];
+      pnumCombos[q] += e->numCombos[i * numRoots + q];
+      if (e->outs) {
+        Combos* chunkOut = &e->outs[i * numRoots + q];
+        if (e->grouped) {
+          BufEachi(chunkOut->groupProb, j) {
+            CombosGroupAdd(&out[q], &e->groups[q], &chunkOut->index[j * comboSize], comboSize,
+              chunkOut->groupProb[j], chunkOut->groupPerms[j]);
+          }
+        } else {
+          BufCat(&out[q].index, chunkOut->index);
+        }
+        CombosFree(chunkOut);
+      }
+    }
+    pres[q] = sum * multiplier;
+    // so the groups add up to the result
+    if (e->grouped) {
+      BufEach(float, out[q].groupProb, p) {
+        *p *= multiplier;
+      }
+    }
+  }
+
+  BufFree(&e->contrib);
+  BufFree(&e->lineRules);
+  BufFree(&e->colAcc);
+  BufFree(&e->ruleLanes);
+  BufFree(&e->runPos);
+  BufFree(&e->runWeight);
+  BufFree(&e->maxRest);
+  BufFree(&e->minRest);
+  BufFree(&e->maxRestForbidden);
+  BufFree(&e->restMass);
+  BufFree(&e->restCount);
+  BufFree(&e->sums);
+  BufFree(&e->numCombos);
+  BufFree(&e->outs);
+  BufEach(CombosGroupIndex, e->groups, g) {
+    CombosGroupIndexFree(g);
+  }
+  BufFree(&e->groups);
+}
+
+//
+// WantTop
+//
+// best-first search for the most likely combos that match. the lines of each slot are sorted
+// by probability, so a combo is a rank for each slot and raising any rank can only make it less
+// likely. every combo has exactly one parent, the same combo with its last non-zero rank lowered
+// by one, so starting from the combo with all ranks at 0 and always expanding the most likely
+// combo in the heap yields combos in descending probability without ever seeing one twice.
+// children that can't lead to a match are never pushed, using the same bounds as WantEval
+//
+
+// the search stops after pushing this many combos
+#define TOP_MAX_NODES (1 << 22)
+
+typedef struct _TopNode {
+  double prob;
+  size_t state; // offset of the ranks in the states Buf, also breaks ties in push order
+  size_t pos;   // children only raise the ranks of slots from pos on
+} TopNode;
+
+static
+int TopNodeBefore(TopNode const* a, TopNode const* b) {
+  return a->prob > b->prob || (a->prob == b->prob && a->state < b->state);
+}
+
+static
+void TopPush(TopNode** pheap, TopNode node) {
+  size_t i = BufLen(*pheap);
+  *BufAlloc(pheap) = node;
+  TopNode* heap = *pheap;
+  while (i && TopNodeBefore(&heap[i], &heap[(i - 1) / 2])) {
+    TopNode tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static
+TopNode TopPop(TopNode* heap) {
+  TopNode top = heap[0];
+  heap[0] = BufAt(heap, -1);
+  BufDel(heap, -1);
+  size_t n = BufLen(heap);
+  for (size_t i = 0; ; ) {
+    size_t best = i;
+    RangeBefore(2, c) {
+      size_t child = i * 2 + 1 + c;
+      if (child < n && TopNodeBefore(&heap[child], &heap[best])) {
+        best = child;
+      }
+    }
+    if (best == i) {
+      break;
+    }
+    TopNode tmp = heap[i];
+    heap[i] = heap[best];
+    heap[best] = tmp;
+    i = best;
+  }
+  return top;
+}
+
+// the search for the k most likely combos that match root, split in begin, run and end like
+// WantEval. the combos are appended to out's index, most likely first. more is set if there are
+// more matching combos (or if the search gave up)
+typedef struct _WantTopData {
+  Lines const* l;
+  float const* slotProbs;
+  WantProg const* prog;
+  int root;
+  WantAcc const* forbidden;
+  size_t k;
+  Combos* out;
+  int more;
+
+  int* contrib;
+  uint32_t* lineRules;
+  size_t comboSize;
+  intmax_t* sorted;
+  size_t* lens;
+  size_t width;
+  int* sufMax;
+  int* restMax;
+  uint8_t* states;
+  TopNode* heap;
+  int* acc;
+  int* counts;
+  int* zeros;
+  uint64_t* bits;
+  uint64_t* done;
+  WantLanes lanes;
+  size_t found;
+} WantTopData;
+
+// nodes to expand between checks of the deadline in WantTopRun
+#define TOP_STEP_NODES 1024
+
+static
+void WantTopBegin(WantTopData* t, Lines const* l, intmax_t const* ranges,
+  float const* slotProbs, WantProg const* prog, int root, WantAcc const* forbidden, size_t k,
+  Combos* out)
+{
+  *t = (WantTopData){
+    .l = l,
+    .slotProbs = slotProbs,
+    .prog = prog,
+    .root = root,
+    .forbidden = forbidden,
+    .k = k,
+    .out = out,
+  };
+
+  size_t numLines = BufLen(l->lineHi);
+  size_t numAccs = BufLen(prog->accs);
+  size_t numForbidden = BufLen(forbidden);
+  size_t comboSize = BufLen(ranges) / 2;
+  WantContribInit(l, prog->accs, forbidden, &t->contrib, &t->lineRules);
+  t->comboSize = comboSize;
+
+  // lines of each slot from most to least likely, lines that can't roll are left out.
+  // width is the most lines any slot has
+  size_t width = 0;
+  RangeBefore(comboSize, s) {
+    width = Max(width, (size_t)(ranges[s * 2 + 1] - ranges[s * 2] + 1));
+  }
+  t->width = width;
+  (void)BufReserve(&t->sorted, comboSize * width);
+  (void)BufReserveZero(&t->lens, comboSize);
+  RangeBefore(comboSize, s) {
+    intmax_t* row = &t->sorted[s * width];
+    float const* probs = &slotProbs[s * numLines];
+    Range(ranges[s * 2], ranges[s * 2 + 1], i) {
+      if (probs[i] <= 0) {
+        continue;
+      }
+      size_t j = t->lens[s]++;
+      for (; j && probs[row[j - 1]] < probs[i]; --j) {
+        row[j] = row[j - 1];
+      }
+      row[j] = i;
+    }
+  }
+
+  // most that the lines of a slot from each rank on can add to each accumulator, and most that
+  // all the slots from each slot on can add
+  (void)BufReserveZero(&t->sufMax, comboSize * width * numAccs);
+  (void)BufReserveZero(&t->restMax, (comboSize + 1) * numAccs);
+  for (intmax_t s = comboSize - 1; s >= 0; --s) {
+    for (intmax_t r = (intmax_t)t->lens[s] - 1; r >= 0; --r) {
+      int* m = &t->sufMax[(s * width + r) * numAccs];
+      RangeBefore(numAccs, a) {
+        int v = t->contrib[t->sorted[s * width + r] * numAccs + a];
+        m[a] = r + 1 < (intmax_t)t->lens[s] ? Max(v, m[numAccs + a]) : v;
+      }
+    }
+    RangeBefore(numAccs, a) {
+      t->restMax[s * numAccs + a] = t->restMax[(s + 1) * numAccs + a] +
+        (t->lens[s] ? t->sufMax[s * width * numAccs + a] : 0);
+    }
+  }
+
+  (void)BufReserve(&t->acc, numAccs);
+  (void)BufReserve(&t->counts, numForbidden);
+  (void)BufReserveZero(&t->zeros, numAccs * KERNEL_PAD(1));
+  (void)BufReserve(&t->bits, BufLen(prog->tests));
+  (void)BufReserve(&t->done, ArrayBitElements(t->done, BufLen(prog->tests)));
+  t->lanes = (WantLanes){
+    .prefix = t->acc,
+    .cols = t->zeros,
+    .stride = KERNEL_PAD(1),
+    .n = 1,
+    .bits = t->bits,
+    .done = t->done,
+  };
+
+  RangeBefore(comboSize, s) {
+    if (!t->lens[s]) {
+      return;
+    }
+  }
+
+  (void)BufReserveZero(&t->states, comboSize);
+  double prob = 1;
+  RangeBefore(comboSize, s) {
+    prob *= slotProbs[s * numLines + t->sorted[s * width]];
+  }
+  TopPush(&t->heap, (TopNode){ .prob = prob });
+}
+
+// expand nodes until the search is over. with a deadline this returns once CubeClockNs()
+// reaches it, checking every TOP_STEP_NODES nodes. returns non-zero once the search is over
+static
+int WantTopRun(WantTopData* t, intmax_t const* deadline) {
+  Lines const* l = t->l;
+  float const* slotProbs = t->slotProbs;
+  WantProg const* prog = t->prog;
+  WantAcc const* forbidden = t->forbidden;
+  int const* contrib = t->contrib;
+  uint32_t const* lineRules = t->lineRules;
+  intmax_t const* sorted = t->sorted;
+  size_t width = t->width;
+  int* acc = t->acc;
+  int* counts = t->counts;
+  size_t numLines = BufLen(l->lineHi);
+  size_t numAccs = BufLen(prog->accs);
+  size_t numForbidden = BufLen(forbidden);
+  size_t comboSize = t->comboSize;
+  size_t expanded = 0;
+
+  // look for one more than k to know if there are more
+  while (BufLen(t->heap) && t->found <= t->k) {
+    if (deadline && ++expanded % TOP_STEP_NODES == 0 && CubeClockNs() >= *deadline) {
+      return 0;
+    }
+    TopNode node = TopPop(t->heap);
+
+    // the combo itself. impossible ones are skipped but their children can still match
+    BufZero(acc);
+    BufZero(counts);
+    int possible = 1;
+    RangeBefore(comboSize, s) {
+      intmax_t i = sorted[s * width + t->states[node.state + s]];
+      RangeBefore(numAccs, a) {
+        acc[a] += contrib[i * numAccs + a];
+      }
+      RangeBefore(numForbidden, f) {
+        if (((lineRules[i] >> f) & 1) && ++counts[f] >= forbidden[f].value) {
+          possible = 0;
+        }
+      }
+    }
+    BufZero(t->done);
+    if (possible && WantProgEval(prog, &t->lanes, t->root, 1)) {
+      if (t->found++ < t->k) {
+        RangeBefore(comboSize, s) {
+          *BufAlloc(&t->out->index) = sorted[s * width + t->states[node.state + s]];
+        }
+      } else {
+        t->more = 1;
+      }
+    }
+
+    Range(node.pos, (intmax_t)comboSize - 1, q) {
+      if (t->states[node.state + q] + 1u >= t->lens[q]) {
+        continue;
+      }
+
+      // the child's subtree has the lines before q fixed, the line of q ranked the same or
+      // worse and anything after q
+      BufZero(acc);
+      BufZero(counts);
+      possible = 1;
+      RangeBefore(q, s) {
+        intmax_t i = sorted[s * width + t->states[node.state + s]];
+        RangeBefore(numAccs, a) {
+          acc[a] += contrib[i * numAccs + a];
+        }
+        RangeBefore(numForbidden, f) {
+          if (((lineRules[i] >> f) & 1) && ++counts[f] >= forbidden[f].value) {
+            possible = 0;
+          }
+        }
+      }
+      size_t rank = t->states[node.state + q] + 1;
+      RangeBefore(numAccs, a) {
+        acc[a] += t->sufMax[(q * width + rank) * numAccs + a] +
+          t->restMax[(q + 1) * numAccs + a];
+      }
+      BufZero(t->done);
+      if (!possible || !WantProgEval(prog, &t->lanes, t->root, 1)) {
+        continue;
+      }
+
+      if (BufLen(t->states) / comboSize >= TOP_MAX_NODES) {
+        t->more = 1;
+        BufClear(t->heap);
+        return 1;
+      }
+      size_t state = BufLen(t->states);
+      RangeBefore(comboSize, s) {
+        uint8_t r = t->states[node.state + s];
+        *BufAlloc(&t->states) = r;
+      }
+      t->states[state + q] = rank;
+      double prob = 1;
+      RangeBefore(comboSize, s) {
+        prob *= slotProbs[s * numLines + sorted[s * width + t->states[state + s]]];
+      }
+      TopPush(&t->heap, (TopNode){ .prob = prob, .state = state, .pos = q });
+    }
+  }
+  return 1;
+}
+
+static
+void WantTopEnd(WantTopData* t) {
+  BufFree(&t->contrib);
+  BufFree(&t->lineRules);
+  BufFree(&t->sorted);
+  BufFree(&t->lens);
+  BufFree(&t->sufMax);
+  BufFree(&t->restMax);
+  BufFree(&t->states);
+  BufFree(&t->heap);
+  BufFree(&t->acc);
+  BufFree(&t->counts);
+  BufFree(&t->zeros);
+  BufFree(&t->bits);
+  BufFree(&t->done);
+}
+
+// the dp engine gives up when the state space gets bigger than this
+#define DP_MAX_STATES (1 << 18)
+
+// a dimension of the dp state space, tracks the accumulated value for one distinct stat mask.
+// values are capped at size - 1 since anything past the highest threshold behaves the same.
+// for the forbidden rules (drop), reaching size means the combo is impossible
+typedef struct _DPDim {
+  int lineHi, lineLo;
+  int count;
+  int drop;
+  int size;
+  size_t stride;
+} DPDim;
+
+// find or add a dimension for a. returns its index
+static
+intmax_t DPDimAdd(DPDim** pdims, WantAcc const* a, int drop) {
+  DPDim* dim = 0;
+  BufEach(DPDim, *pdims, d) {
+    if (d->lineHi == a->lineHi && d->lineLo == a->lineLo && d->count == a->count &&
+        d->drop == drop)
+    {
+      dim = d;
+      break;
+    }
+  }
+  if (!dim) {
+    dim = BufAlloc(pdims);
+    *dim = (DPDim){
+      .lineHi = a->lineHi,
+      .lineLo = a->lineLo,
+      .count = a->count,
+      .drop = drop,
+      .size = drop ? a->value : 1,
+    };
+  }
+  if (drop) {
+    dim->size = Min(dim->size, a->value);
+  } else {
+    dim->size = Max(dim->size, a->value + 1);
+  }
+  return dim - *pdims;
+}
+
+static
+void DPDecode(DPDim const* dims, size_t state, int* coords) {
+  BufEachi(dims, k) {
+    coords[k] = state % dims[k].size;
+    state /= dims[k].size;
+  }
+}
+
+// exact probability of rolling any combo matching wantBuf, by dynamic programming over the
+// distribution of accumulated values instead of enumerating combos.
+//
+// the state is the accumulated value of every distinct stat mask in wantBuf plus the line counts
+// for the forbidden rules. we keep the probability of every state and fold in one slot at a
+// time, so the cost grows with slots * states * lines instead of lines^slots.
+// slotProbs already has the prime/non-prime chance of each slot baked in.
+// wantBuf is then evaluated once per final state, which covers any nesting of AND/OR as well as
+// "any N lines" without having to do inclusion-exclusion.
+//
+// like WantEval, several wants can be evaluated at once by passing the root of each in roots.
+// pres has one element per root
+//
+// returns 0 without doing anything if the state space is too big for this to be worth it
+static
+int WantEvalDP(Lines const* l, intmax_t const* ranges, float const* slotProbs,
+  WantProg const* prog, int const* roots, WantAcc const* forbidden, float multiplier,
+  float* pres)
+{
+  int res = 0;
+  DPDim* dims = 0;
+  intmax_t* accDims = 0;
+  int* contrib = 0;
+  int* coords = 0;
+  int* acc = 0;
+  int* zeros = 0;
+  uint64_t* bits = 0;
+  uint64_t* done = 0;
+  double* cur = 0;
+  double* next = 0;
+  double* sums = 0;
+
+  size_t numLines = BufLen(l->lineHi);
+  size_t comboSize = BufLen(ranges) / 2;
+  size_t numRoots = BufLen(roots);
+
+  BufEach(WantAcc const, prog->accs, a) {
+    *BufAlloc(&accDims) = (a->lineHi || a->lineLo) ? DPDimAdd(&dims, a, 0) : -1;
+  }
+
+  BufEach(WantAcc const, forbidden, a) {
+    // rules that can't be triggered by any of the lines don't need to be tracked
+    RangeBefore(numLines, i) {
+      if (LineMatches(l, i, a->lineHi, a->lineLo)) {
+        DPDimAdd(&dims, a, 1);
+        break;
+      }
+    }
+  }
+
+  size_t numDims = BufLen(dims);
+  size_t numStates = 1;
+  BufEach(DPDim, dims, d) {
+    d->stride = numStates;
+    numStates *= d->size;
+    if (numStates > DP_MAX_STATES) {
+      goto cleanup;
+    }
+  }
+
+  // only worth it if it beats enumerating every combo. slots with the same range are walked as
+  // multisets by WantEval (runs of k slots over n lines give (n + k - 1 choose k) combos)
+  double dpCost = 0, enumCost = 1;
+  intmax_t runLen = 0;
+  RangeBefore(comboSize, j) {
+    double n = ranges[j * 2 + 1] - ranges[j * 2] + 1;
+    dpCost += numStates * n;
+    if (j && ranges[j * 2] == ranges[j * 2 - 2] && ranges[j * 2 + 1] == ranges[j * 2 - 1]) {
+      ++runLen;
+    } else {
+      runLen = 0;
+    }
+    enumCost *= (n + runLen) / (runLen + 1);
+  }
+  if (dpCost >= enumCost) {
+    goto cleanup;
+  }
+
+  (void)BufReserve(&contrib, numLines * numDims);
+  RangeBefore(numLines, i) {
+    RangeBefore(numDims, k) {
+      DPDim const* d = &dims[k];
+      int match = LineMatches(l, i, d->lineHi, d->lineLo);
+      contrib[i * numDims + k] = match * (d->count ? 1 : l->value[i]);
+    }
+  }
+
+  (void)BufReserveZero(&cur, numStates);
+  (void)BufReserve(&next, numStates);
+  (void)BufReserve(&coords, numDims);
+  (void)BufReserve(&acc, BufLen(prog->accs));
+  (void)BufReserveZero(&zeros, BufLen(prog->accs) * KERNEL_PAD(1));
+  (void)BufReserve(&bits, BufLen(prog->tests));
+  (void)BufReserve(&done, ArrayBitElements(done, BufLen(prog->tests)));
+
+  cur[0] = 1;
+  RangeBefore(comboSize, slot) {
+    BufZero(next);
+    RangeBefore(numStates, s) {
+      double p = cur[s];
+      if (p == 0) {
+        continue;
+      }
+      DPDecode(dims, s, coords);
+      Range(ranges[slot * 2], ranges[slot * 2 + 1], i) {
+        size_t ns = 0;
+        RangeBefore(numDims, k) {
+          DPDim const* d = &dims[k];
+          int v = coords[k] + contrib[i * numDims + k];
+          if (v >= d->size) {
+            if (d->drop) {
+              goto nextLine;
+            }
+            v = d->size - 1;
+          }
+          ns += v * d->stride;
+        }
+        next[ns] += p * slotProbs[slot * numLines + i];
+nextLine:;
+      }
+    }
+    double* tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+
+  // evaluate the final states as a single lane with nothing left to add
+  WantLanes lanes = {
+    .prefix = acc,
+    .cols = zeros,
+    .stride = KERNEL_PAD(1),
+    .n = 1,
+    .bits = bits,
+    .done = done,
+  };
+  (void)BufReserveZero(&sums, numRoots);
+  RangeBefore(numStates, s) {
+    if (cur[s] == 0) {
+      continue;
+    }
+    DPDecode(dims, s, coords);
+    BufEachi(accDims, k) {
+      acc[k] = accDims[k] >= 0 ? coords[accDims[k]] : 0;
+    }
+    BufZero(done);
+    RangeBefore(numRoots, q) {
+      if (WantProgEval(prog, &lanes, roots[q], 1)) {
+        sums[q] += cur[s];
+      }
+    }
+  }
+  RangeBefore(numRoots, q) {
+    pres[q] = sums[q] * multiplier;
+  }
+  res = 1;
+
+cleanup:
+  BufFree(&dims);
+  BufFree(&accDims);
+  BufFree(&contrib);
+  BufFree(&coords);
+  BufFree(&acc);
+  BufFree(&zeros);
+  BufFree(&bits);
+  BufFree(&done);
+  BufFree(&cur);
+  BufFree(&next);
+  BufFree(&sums);
+  return res;
+}
+
+//
+// joint histogram
+//
+// the distribution of the accumulated value of a set of accumulators over every possible combo,
+// stored sparsely as a list of (values, probability) entries. it's built the same way as the dp
+// above but values are not capped, so any threshold and any AND/OR structure on the same
+// accumulators can be answered from it without going through the lines again
+//
+
+// give up building a histogram when it has more states than this
+#define HIST_MAX_STATES (1 << 18)
+
+typedef struct _WantHist {
+  WantAcc* accs;  // the dimensions. value is the highest value that can be reached
+  int* values;    // BufLen(accs) values for each entry
+  double* mass;   // probability of each entry
+} WantHist;
+
+static
+void WantHistFree(WantHist* h) {
+  BufFree(&h->accs);
+  BufFree(&h->values);
+  BufFree(&h->mass);
+}
+
+// find the dimension of h for each accumulator of prog, -1 for accumulators without a mask.
+// returns 0 if h doesn't cover prog
+static
+int WantHistMap(WantHist const* h, WantProg const* prog, intmax_t* dimOf) {
+  BufEachi(prog->accs, k) {
+    WantAcc const* a = &prog->accs[k];
+    dimOf[k] = -1;
+    if (!a->lineHi && !a->lineLo) {
+      continue;
+    }
+    BufEachi(h->accs, j) {
+      WantAcc const* d = &h->accs[j];
+      if (d->lineHi == a->lineHi && d->lineLo == a->lineLo && d->count == a->count) {
+        dimOf[k] = j;
+        break;
+      }
+    }
+    if (dimOf[k] < 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// find or add the state key to the sparse state list. index has the index + 1 of every state.
+// returns the index of the state
+static
+size_t WantHistState(HashIndex* index, int** pkeys, double** pmass, int key) {
+  size_t cursor = 0;
+  for (uintptr_t i; (i = HashIndexNext(index, (unsigned)key, &cursor));) {
+    if ((*pkeys)[i - 1] == key) {
+      return i - 1;
+    }
+  }
+  *BufAlloc(pkeys) = key;
+  *BufAlloc(pmass) = 0;
+  (void)HashIndexAdd(index, (unsigned)key, BufLen(*pkeys));
+  return BufLen(*pkeys) - 1;
+}
+
+// build the histogram of accs (only the masks and count are used) into h.
+// returns 0 if there would be too many states
+static
+int WantHistBuild(Lines const* l, intmax_t const* ranges, float const* slotProbs,
+  WantAcc const* accs, WantAcc const* forbidden, WantHist* h)
+{
+  int res = 0;
+  DPDim* dims = 0;
+  int* contrib = 0;
+  int* coords = 0;
+  int* keys = 0;
+  int* nextKeys = 0;
+  double* mass = 0;
+  double* nextMass = 0;
+  HashIndex index = {0};
+
+  size_t numLines = BufLen(l->lineHi);
+  size_t comboSize = BufLen(ranges) / 2;
+
+  WantHistFree(h);
+
+  // accumulators are never capped, the size is the highest value that can be reached + 1
+  BufEach(WantAcc const, accs, a) {
+    if (!a->lineHi && !a->lineLo) {
+      continue;
+    }
+    WantAcc reach = *a;
+    reach.value = 0;
+    RangeBefore(comboSize, slot) {
+      int best = 0;
+      Range(ranges[slot * 2], ranges[slot * 2 + 1], i) {
+        if (LineMatches(l, i, a->lineHi, a->lineLo)) {
+          best = Max(best, a->count ? 1 : l->value[i]);
+        }
+      }
+      reach.value += best;
+    }
+    intmax_t k = DPDimAdd(&dims, &reach, 0);
+    if (k == (intmax_t)BufLen(h->accs)) {
+      *BufAlloc(&h->accs) = reach;
+    }
+  }
+  size_t numAccDims = BufLen(dims);
+
+  BufEach(WantAcc const, forbidden, a) {
+    RangeBefore(numLines, i) {
+      if (LineMatches(l, i, a->lineHi, a->lineLo)) {
+        DPDimAdd(&dims, a, 1);
+        break;
+      }
+    }
+  }
+
+  // states are keyed by an int, so the whole state space must fit one
+  size_t numDims = BufLen(dims);
+  size_t numStates = 1;
+  BufEach(DPDim, dims, d) {
+    d->stride = numStates;
+    numStates *= d->size;
+    if (numStates > INT_MAX) {
+      goto cleanup;
+    }
+  }
+
+  (void)BufReserve(&contrib, numLines * numDims);
+  RangeBefore(numLines, i) {
+    RangeBefore(numDims, k) {
+      DPDim const* d = &dims[k];
+      int match = LineMatches(l, i, d->lineHi, d->lineLo);
+      contrib[i * numDims + k] = match * (d->count ? 1 : l->value[i]);
+    }
+  }
+  (void)BufReserve(&coords, numDims);
+
+  *BufAlloc(&keys) = 0;
+  *BufAlloc(&mass) = 1;
+  RangeBefore(comboSize, slot) {
+    HashIndexClear(&index);
+    BufClear(nextKeys);
+    BufClear(nextMass);
+    BufEachi(keys, s) {
+      DPDecode(dims, keys[s], coords);
+      Range(ranges[slot * 2], ranges[slot * 2 + 1], i) {
+        size_t ns = 0;
+        RangeBefore(numDims, k) {
+          DPDim const* d = &dims[k];
+          int v = coords[k] + contrib[i * numDims + k];
+          if (v >= d->size) {
+            // only forbidden dims can overflow
+            goto nextLine;
+          }
+          ns += v * d->stride;
+        }
+        size_t j = WantHistState(&index, &nextKeys, &nextMass, ns);
+        nextMass[j] += mass[s] * slotProbs[slot * numLines + i];
+nextLine:;
+      }
+      if (BufLen(nextKeys) > HIST_MAX_STATES) {
+        goto cleanup;
+      }
+    }
+
+    int* tmpKeys = keys;
+    keys = nextKeys;
+    nextKeys = tmpKeys;
+    double* tmpMass = mass;
+    mass = nextMass;
+    nextMass = tmpMass;
+  }
+
+  // sum up the states that only differ by the forbidden dims, they are not needed anymore
+  HashIndexClear(&index);
+  BufClear(nextKeys);
+  BufClear(nextMass);
+  BufEachi(keys, s) {
+    int key = 0;
+    size_t stride = 1;
+    DPDecode(dims, keys[s], coords);
+    RangeBefore(numAccDims, k) {
+      key += coords[k] * stride;
+      stride *= dims[k].size;
+    }
+    size_t j = WantHistState(&index, &nextKeys, &nextMass, key);
+    nextMass[j] += mass[s];
+  }
+  BufEachi(nextKeys, s) {
+    int key = nextKeys[s];
+    RangeBefore(numAccDims, k) {
+      *BufAlloc(&h->values) = key % dims[k].size;
+      key /= dims[k].size;
+    }
+    *BufAlloc(&h->mass) = nextMass[s];
+  }
+  res = 1;
+
+cleanup:
+  HashIndexFree(&index);
+  BufFree(&dims);
+  BufFree(&contrib);
+  BufFree(&coords);
+  BufFree(&keys);
+  BufFree(&nextKeys);
+  BufFree(&mass);
+  BufFree(&nextMass);
+  if (!res) {
+    WantHistFree(h);
+  }
+  return res;
+}
+
+// evaluate the roots of prog on every entry of the histogram, pres has one element per root.
+// dimOf is from WantHistMap
+static
+void WantHistEval(WantHist const* h, WantProg const* prog, int const* roots,
+  intmax_t const* dimOf, float multiplier, float* pres)
+{
+  int* acc = 0;
+  int* zeros = 0;
+  uint64_t* bits = 0;
+  uint64_t* done = 0;
+  double* sums = 0;
+
+  size_t numDims = BufLen(h->accs);
+  size_t numRoots = BufLen(roots);
+  (void)BufReserve(&acc, BufLen(prog->accs));
+  (void)BufReserveZero(&zeros, BufLen(prog->accs) * KERNEL_PAD(1));
+  (void)BufReserve(&bits, BufLen(prog->tests));
+  (void)BufReserve(&done, ArrayBitElements(done, BufLen(prog->tests)));
+  (void)BufReserveZero(&sums, numRoots);
+
+  WantLanes lanes = {
+    .prefix = acc,
+    .cols = zeros,
+    .stride = KERNEL_PAD(1),
+    .n = 1,
+    .bits = bits,
+    .done = done,
+  };
+  BufEachi(h->mass, e) {
+    int const* values = &h->values[e * numDims];
+    BufEachi(prog->accs, k) {
+      acc[k] = dimOf[k] >= 0 ? values[dimOf[k]] : 0;
+    }
+    BufZero(done);
+    RangeBefore(numRoots, q) {
+      if (WantProgEval(prog, &lanes, roots[q], 1)) {
+        sums[q] += h->mass[e];
+      }
+    }
+  }
+  RangeBefore(numRoots, q) {
+    pres[q] = sums[q] * multiplier;
+  }
+
+  BufFree(&acc);
+  BufFree(&zeros);
+  BufFree(&bits);
+  BufFree(&done);
+  BufFree(&sums);
+}
+
+//
+// CubeCache
+//
+// results are found by the hash of their key in a HashIndex, so a miss stops at the first empty
+// slot instead of costing more as the cache fills up. every entry is also in a doubly linked
+// list ordered by last use so we can evict the least recently used ones when we go over budget
+//
+
+typedef struct _CubeCacheKey {
+  uint64_t hash;
+  Want const* want;
+  int category, cube, tier;
+  size_t group;
+  int region; // see CubeRuleRegion
+} CubeCacheKey;
+
+struct _CubeCacheEntry {
+  CubeCacheEntry* prev; // more recently used
+  CubeCacheEntry* next; // less recently used
+  CubeCacheKey key; // key.want is owned by the entry
+  float p;
+  int hasCombos;
+  Combos combos;
+  size_t bytes;
+};
+
+#define CUBE_CACHE_DEFAULT_BUDGET (64 << 20)
+
+static
+CubeCacheKey CubeCacheKeyInit(Want const* wantBuf, int category, int cube, int tier,
+  size_t group, int region)
+{
+  CubeCacheKey key = {
+    .want = wantBuf,
+    .category = category,
+    .cube = cube,
+    .tier = tier,
+    .group = group,
+    .region = region,
+  };
+  int fields[5] = { category, cube, tier, group, region };
+  key.hash = HashBytes(fields, sizeof(fields), WantHash(wantBuf));
+  return key;
+}
+
+static
+int WantEq(Want const* a, Want const* b) {
+  if (BufLen(a) != BufLen(b)) {
+    return 0;
+  }
+  BufEachi(a, i) {
+    Want const* x = &a[i];
+    Want const* y = &b[i];
+    if (x->type != y->type) {
+      return 0;
+    }
+    if (x->type == WANT_OP) {
+      if (x->op != y->op || x->opCount != y->opCount) {
+        return 0;
+      }
+    } else if (x->lineHi != y->lineHi || x->lineLo != y->lineLo || x->value != y->value) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static
+int CubeCacheKeyEq(CubeCacheKey const* a, CubeCacheKey const* b) {
+  return a->hash == b->hash && a->category == b->category && a->cube == b->cube &&
+    a->tier == b->tier && a->group == b->group && a->region == b->region &&
+    WantEq(a->want, b->want);
+}
+
+// must be called with the lock held. if probes is non-NULL, it's incremented by the number of
+// slots looked at, including the empty one that ends a miss
+static
+CubeCacheEntry* CubeCacheFind(CubeContext* ctx, CubeCacheKey const* key, size_t* probes) {
+  size_t cursor = 0;
+  CubeCacheEntry* res = 0;
+  for (uintptr_t v; (v = HashIndexNext(&ctx->cacheIndex, key->hash, &cursor));) {
+    CubeCacheEntry* e = (CubeCacheEntry*)v;
+    if (CubeCacheKeyEq(&e->key, key)) {
+      res = e;
+      break;
+    }
+  }
+  if (probes) {
+    *probes += cursor + !res;
+  }
+  return res;
+}
+
+static
+void CubeCacheUnlink(CubeContext* ctx, CubeCacheEntry* e) {
+  if (e->prev) e->prev->next = e->next; else ctx->cacheHead = e->next;
+  if (e->next) e->next->prev = e->prev; else ctx->cacheTail = e->prev;
+  e->prev = e->next = 0;
+}
+
+static
+void CubeCacheLinkHead(CubeContext* ctx, CubeCacheEntry* e) {
+  e->next = ctx->cacheHead;
+  if (ctx->cacheHead) ctx->cacheHead->prev = e; else ctx->cacheTail = e;
+  ctx->cacheHead = e;
+}
+
+// unlink e from everything and free it. must be called with the lock held
+static
+void CubeCacheRemove(CubeContext* ctx, CubeCacheEntry* e) {
+  HashIndexDel(&ctx->cacheIndex, e->key.hash, (uintptr_t)e);
+  CubeCacheUnlink(ctx, e);
+  ctx->cacheStats.bytes -= e->bytes;
+  --ctx->cacheStats.entries;
+  BufFree((Want**)&e->key.want);
+  CombosFree(&e->combos);
+  free(e);
+}
+
+// must be called with the lock held
+static
+void CubeCacheEvict(CubeContext* ctx, size_t budget) {
+  while (ctx->cacheTail && ctx->cacheStats.bytes > budget) {
+    CubeCacheRemove(ctx, ctx->cacheTail);
+    ++ctx->cacheStats.evictions;
+  }
+}
+
+// look up a result. if outCombos is non-NULL, only entries that kept their combos count and
+// a copy of the combos is stored in outCombos. returns non-zero on hits
+static
+int CubeCacheGet(CubeContext* ctx, CubeCacheKey const* key, float* p, Combos* outCombos) {
+  int res = 0;
+  CubeLock(&ctx->cacheMutex);
+  CubeCacheEntry* e = CubeCacheFind(ctx, key, &ctx->cacheStats.probes);
+  if (e && (!outCombos || e->hasCombos)) {
+    CubeCacheUnlink(ctx, e);
+    CubeCacheLinkHead(ctx, e);
+    *p = e->p;
+    if (outCombos) {
+      CombosDup(outCombos, &e->combos);
+    }
+    ++ctx->cacheStats.hits;
+    res = 1;
+  } else {
+    ++ctx->cacheStats.misses;
+  }
+  CubeUnlock(&ctx->cacheMutex);
+  return res;
+}
+
+// store a result. combos can be NULL. a copy of the key's want and the combos is made
+static
+void CubeCachePut(CubeContext* ctx, CubeCacheKey const* key, float p, Combos const* combos) {
+  CubeLock(&ctx->cacheMutex);
+  if (!ctx->cacheStats.budget) {
+    goto cleanup;
+  }
+
+  int keepCombos = combos && ctx->cacheKeepCombos;
+  size_t bytes = sizeof(CubeCacheEntry) + BufLen(key->want) * sizeof(Want) +
+    (keepCombos ? CombosBytes(combos) : 0);
+  if (bytes > ctx->cacheStats.budget) {
+    goto cleanup;
+  }
+
+  CubeCacheEntry* e = CubeCacheFind(ctx, key, 0);
+  if (e) {
+    // another thread got here first or we are adding combos to an existing entry
+    if (e->hasCombos || !keepCombos) {
+      goto cleanup;
+    }
+    CubeCacheRemove(ctx, e);
+  }
+
+  e = malloc(sizeof(CubeCacheEntry));
+  MemZero(e);
+  e->key = *key;
+  e->key.want = BufDup((Want*)key->want);
+  e->p = p;
+  e->bytes = bytes;
+  if (keepCombos) {
+    e->hasCombos = 1;
+    CombosDup(&e->combos, combos);
+  }
+
+  if (!HashIndexAdd(&ctx->cacheIndex, key->hash, (uintptr_t)e)) {
+    BufFree((Want**)&e->key.want);
+    CombosFree(&e->combos);
+    free(e);
+    goto cleanup;
+  }
+  CubeCacheLinkHead(ctx, e);
+  ctx->cacheStats.bytes += bytes;
+  ++ctx->cacheStats.entries;
+  CubeCacheEvict(ctx, ctx->cacheStats.budget);
+
+cleanup:
+  CubeUnlock(&ctx->cacheMutex);
+}
+
+void CubeCacheConfig(CubeContext* ctx, size_t budget, int keepCombos) {
+  CubeLock(&ctx->cacheMutex);
+  ctx->cacheStats.budget = budget;
+  ctx->cacheKeepCombos = keepCombos;
+  CubeCacheEvict(ctx, budget);
+  CubeUnlock(&ctx->cacheMutex);
+}
+
+void CubeCacheClear(CubeContext* ctx) {
+  CubeLock(&ctx->cacheMutex);
+  while (ctx->cacheHead) {
+    CubeCacheRemove(ctx, ctx->cacheHead);
+  }
+  HashIndexFree(&ctx->cacheIndex);
+  CubeUnlock(&ctx->cacheMutex);
+}
+
+CubeCacheStats CubeCacheGetStats(CubeContext* ctx) {
+  CubeLock(&ctx->cacheMutex);
+  CubeCacheStats res = ctx->cacheStats;
+  CubeUnlock(&ctx->cacheMutex);
+  return res;
+}
+
+//
+// CubeConfig
+//
+// configurations are kept in a Buf and looked up linearly, there's only ever a handful.
+// unused ones are kept around so they can be picked up again, up to CUBE_CONFIG_MAX in total
+//
+
+#define CUBE_CONFIG_MAX 32
+#define HIST_PER_CONFIG 4
+
+struct _CubeConfig {
+  CubeContext* ctx;
+  int category, cube, tier;
+  size_t group;
+  int region; // see CubeRuleRegion
+  int maskHi, maskLo;
+  int refs;
+  size_t lastUse;
+  Lines lines; // filtered by the mask, onein is the probability of the line
+  intmax_t* ranges;
+  float* slotProbs; // probability of each line for each slot, see WantEval
+  float* primeMul;
+  WantAcc* forbidden;
+  float multiplier;
+  WantHist** hists; // never removed until the configuration is freed, up to HIST_PER_CONFIG
+  int histMisses;   // queries that weren't covered by a histogram
+};
+
+static
+void CubeConfigFree(CubeConfig* c) {
+  LinesFree(&c->lines);
+  BufFree(&c->ranges);
+  BufFree(&c->slotProbs);
+  BufFree(&c->primeMul);
+  BufFree(&c->forbidden);
+  BufEach(WantHist*, c->hists, ph) {
+    WantHistFree(*ph);
+    free(*ph);
+  }
+  BufFree(&c->hists);
+  free(c);
+}
+
+static
+CubeConfig* CubeConfigBuild(CubeContext* ctx, Category category, Cube cube, Tier tier,
+  size_t group, int region, int maskHi, int maskLo)
+{
+  CubeConfig* c = malloc(sizeof(CubeConfig));
+  MemZero(c);
+  c->ctx = ctx;
+  c->category = category;
+  c->cube = cube;
+  c->tier = tier;
+  c->group = group;
+  c->region = region;
+  c->maskHi = maskHi;
+  c->maskLo = maskLo;
+
+  LineData const* data[2];
+  if (!ForbiddenInit(&ctx->data, &c->forbidden, category, cube, region) ||
+      !CubeLinesInit(ctx, &c->lines, category, cube, tier, group, data))
+  {
+    goto fail;
+  }
+
+#ifdef CUBECALC_DEBUG
+  {
+    size_t numPrimes = LinesNumPrimes(&c->lines);
+    puts("");
+    puts("# prime");
+    DataPrint(data[0], tier, c->lines.value);
+    puts("");
+    puts("# nonprime");
+    DataPrint(data[1], tier - 1, c->lines.value + numPrimes);
+  }
+#endif
+
+  intmax_t numPrimes = LinesPrepare(&c->lines, maskHi, maskLo);
+  if (BufLen(c->lines.lineHi) > UINT8_MAX + 1) {
+    fprintf(stderr, "too many lines for the combo index (%zu)\n", BufLen(c->lines.lineHi));
+    goto fail;
+  }
+  c->ranges = CubeRanges(cube, &c->lines, numPrimes);
+  c->lines.comboSize = BufLen(c->ranges) / 2;
+  size_t comboSize = c->lines.comboSize;
+
+  float const* primeChanceData = PrimeChanceFind(&ctx->data, cube, tier);
+  if (!primeChanceData) {
+    fprintf(stderr, "no prime chances for cube 0x%x tier %d\n", cube, tier);
+    goto fail;
+  }
+
+  {
+    size_t len = BufLen(primeChanceData);
+    if (len != comboSize) {
+      fprintf(stderr, "expected %zu prime chances, got %zu\n", comboSize, len);
+      goto fail;
+    }
+  }
+
+  // multiply line probabilities by prime chance for every slot
+  // to make it branchless, we prepend the non-prime chances and then we mul the index by prime bit
+  // example:
+  //   multipliers = [1 - primeChance1, 1 - primeChance2, 1 - primeChance3,
+  //                      primeChance1,     primeChance2,     primeChance3]
+  //   index = slot + IsPrime * 3
+
+  {
+    (void)BufReserve(&c->primeMul, comboSize * 2);
+    float* primeMul = c->primeMul;
+    RangeBefore(comboSize, i) {
+      primeMul[i] = 1 - primeChanceData[i];
+      primeMul[i + comboSize] = primeChanceData[i];
+    }
+
+    size_t numLines = BufLen(c->lines.lineHi);
+    (void)BufReserve(&c->slotProbs, numLines * comboSize);
+    RangeBefore(comboSize, slot) {
+      RangeBefore(numLines, i) {
+        size_t idx = slot + ArrayBitVal(c->lines.prime, i) * comboSize;
+        c->slotProbs[slot * numLines + i] = c->lines.onein[i] * primeMul[idx];
+      }
+    }
+  }
+
+  c->multiplier = cube == UNI ? 1 / 3.0 : 1;
+  // ^ on unicubes, you spend an average of 3 cubes to select the line and roll it once
+
+  return c;
+
+fail:
+  CubeConfigFree(c);
+  return 0;
+}
+
+// free the least recently used configurations that are not in use until we are within
+// CUBE_CONFIG_MAX. must be called with the lock held
+static
+void CubeConfigEvict(CubeContext* ctx, size_t max) {
+  while (BufLen(ctx->configs) > max) {
+    intmax_t lru = -1;
+    BufEachi(ctx->configs, i) {
+      CubeConfig* c = ctx->configs[i];
+      if (!c->refs && (lru < 0 || c->lastUse < ctx->configs[lru]->lastUse)) {
+        lru = i;
+      }
+    }
+    if (lru < 0) {
+      break;
+    }
+    CubeConfigFree(ctx->configs[lru]);
+    ctx->configs[lru] = BufAt(ctx->configs, -1);
+    --BufHdr(ctx->configs)->len;
+  }
+}
+
+// must be called with the lock held
+static
+CubeConfig* CubeConfigFind(CubeContext* ctx, Category category, Cube cube, Tier tier,
+  size_t group, int region, int maskHi, int maskLo)
+{
+  BufEach(CubeConfig*, ctx->configs, pc) {
+    CubeConfig* c = *pc;
+    if (c->category == (int)category && c->cube == (int)cube && c->tier == (int)tier &&
+        c->group == group && c->region == region &&
+        c->maskHi == maskHi && c->maskLo == maskLo)
+    {
+      ++c->refs;
+      c->lastUse = ++ctx->configClock;
+      return c;
+    }
+  }
+  return 0;
+}
+
+static
+CubeConfig* CubeConfigGetGroup(CubeContext* ctx, Category category, Cube cube, Tier tier,
+  size_t group, int region, int maskHi, int maskLo)
+{
+  CubeLock(&ctx->configMutex);
+  CubeConfig* c = CubeConfigFind(ctx, category, cube, tier, group, region, maskHi, maskLo);
+  CubeUnlock(&ctx->configMutex);
+  if (c) {
+    return c;
+  }
+
+  // build it without holding the lock. if another thread beat us to it, use theirs
+  CubeConfig* built = CubeConfigBuild(ctx, category, cube, tier, group, region, maskHi,
+    maskLo);
+  if (!built) {
+    return 0;
+  }
+
+  CubeLock(&ctx->configMutex);
+  c = CubeConfigFind(ctx, category, cube, tier, group, region, maskHi, maskLo);
+  if (c) {
+    CubeConfigFree(built);
+  } else {
+    c = built;
+    c->refs = 1;
+    c->lastUse = ++ctx->configClock;
+    *BufAlloc(&ctx->configs) = c;
+    CubeConfigEvict(ctx, CUBE_CONFIG_MAX);
+  }
+  CubeUnlock(&ctx->configMutex);
+  return c;
+}
+
+CubeConfig* CubeConfigGet(CubeContext* ctx, Category category, Cube cube, Tier tier, int lvl,
+  Region region, Want const* wantBuf)
+{
+  int maskHi, maskLo;
+  WantMask(wantBuf, &maskHi, &maskLo);
+  size_t group = ValueGroupFind(ctx, cube, category, region, lvl);
+  return CubeConfigGetGroup(ctx, category, cube, tier, group, CubeRuleRegion(ctx, region),
+    maskHi, maskLo);
+}
+
+void CubeConfigRelease(CubeConfig* c) {
+  if (c) {
+    CubeContext* ctx = c->ctx;
+    CubeLock(&ctx->configMutex);
+    --c->refs;
+    CubeConfigEvict(ctx, CUBE_CONFIG_MAX);
+    CubeUnlock(&ctx->configMutex);
+  }
+}
+
+void CubeConfigClear(CubeContext* ctx) {
+  CubeLock(&ctx->configMutex);
+  CubeConfigEvict(ctx, 0);
+  if (!BufLen(ctx->configs)) {
+    BufFree(&ctx->configs);
+  }
+  CubeUnlock(&ctx->configMutex);
+}
+
+void CubeHistConfig(CubeContext* ctx, int enable) {
+  CubeLock(&ctx->configMutex);
+  ctx->histEnable = enable;
+  CubeUnlock(&ctx->configMutex);
+}
+
+// evaluate the roots of prog from a histogram of c, building one if none of them covers prog and
+// c has been queried before. histograms are shared by every thread so they are never modified
+// once added. returns 0 if no histogram was used
+static
+int CubeConfigHistEval(CubeConfig const* cc, WantProg const* prog, int const* roots,
+  float* pres)
+{
+  // the histograms are a cache, they don't change what the configuration calculates
+  CubeConfig* c = (CubeConfig*)cc;
+  CubeContext* ctx = c->ctx;
+  WantHist* found = 0;
+  WantHist* last = 0;
+  intmax_t* dimOf = 0;
+  (void)BufReserve(&dimOf, BufLen(prog->accs));
+
+  CubeLock(&ctx->configMutex);
+  int enable = ctx->histEnable;
+  BufEach(WantHist*, c->hists, ph) {
+    if (WantHistMap(*ph, prog, dimOf)) {
+      found = *ph;
+      break;
+    }
+  }
+  if (BufLen(c->hists)) {
+    last = BufAt(c->hists, -1);
+  }
+  // building is slower than a single dp or enumeration, only worth it once the configuration
+  // is being queried repeatedly
+  if (!found && c->histMisses++ < 1) {
+    enable = 0;
+  }
+  CubeUnlock(&ctx->configMutex);
+
+  if (!enable) {
+    BufFree(&dimOf);
+    return 0;
+  }
+
+  WantHist* built = 0;
+  if (!found) {
+    // also cover the stats of the last histogram so wants that alternate between a few sets of
+    // stats end up sharing one
+    WantAcc* accs = 0;
+    if (last) {
+      BufEach(WantAcc, last->accs, a) {
+        *BufAlloc(&accs) = *a;
+      }
+    }
+    BufEach(WantAcc const, prog->accs, a) {
+      *BufAlloc(&accs) = *a;
+    }
+    built = malloc(sizeof(WantHist));
+    MemZero(built);
+    if (!WantHistBuild(&c->lines, c->ranges, c->slotProbs, accs, c->forbidden, built) &&
+        (!last || !WantHistBuild(&c->lines, c->ranges, c->slotProbs, prog->accs,
+                                 c->forbidden, built)))
+    {
+      BufFree(&accs);
+      free(built);
+      BufFree(&dimOf);
+      return 0;
+    }
+    BufFree(&accs);
+    WantHistMap(built, prog, dimOf);
+    found = built;
+  }
+
+  WantHistEval(found, prog, roots, dimOf, c->multiplier, pres);
+  BufFree(&dimOf);
+
+  if (built) {
+    CubeLock(&ctx->configMutex);
+    if (BufLen(c->hists) < HIST_PER_CONFIG) {
+      *BufAlloc(&c->hists) = built;
+      built = 0;
+    }
+    CubeUnlock(&ctx->configMutex);
+    if (built) {
+      WantHistFree(built);
+      free(built);
+    }
+  }
+  return 1;
+}
+
+// the wants of a CubeConfigCalcEach that have to go through the combos, merged into a single
+// prog so they're evaluated in one pass
+typedef struct _CubeConfigEval {
+  WantProg* progs;
+  WantProg merged;
+  int* roots;
+  intmax_t* pending; // wants that have to be enumerated, in the same order as roots
+  Combos* combos;
+  WantEvalData e;    // only set up if there's anything pending
+} CubeConfigEval;
+
+// ok[i] is set to 0 if wantBufs[i] is invalid, the other wants are still calculated.
+// results that don't need to go through the combos are stored right away, the others once the
+// chunks of ev->e have been ran with WantEvalRun and CubeConfigEvalEnd is called
+static
+void CubeConfigEvalBegin(CubeConfigEval* ev, CubeConfig const* c, Want const* const* wantBufs,
+  size_t n, float* p, Combos* outCombos, int* ok)
+{
+  *ev = (CubeConfigEval){0};
+
+  RangeBefore(n, i) {
+    p[i] = 0;
+    if (outCombos) {
+      outCombos[i] = (Combos){ .comboSize = c->lines.comboSize };
+    }
+  }
+
+  (void)BufReserveZero(&ev->progs, n);
+  RangeBefore(n, i) {
+    int maskHi, maskLo;
+    WantMask(wantBufs[i], &maskHi, &maskLo);
+    if ((maskHi & ~c->maskHi) || (maskLo & ~c->maskLo)) {
+      fprintf(stderr, "want mentions stats that are not in the configuration\n");
+      ok[i] = 0;
+    } else {
+      ok[i] = WantCompile(wantBufs[i], &ev->progs[i]);
+    }
+  }
+
+  int* root = 0;
+  *BufAlloc(&root) = 0;
+  RangeBefore(n, i) {
+    if (!ok[i]) {
+      continue;
+    }
+    // the histogram and dp engines can't tell which combos matched, so they are only used
+    // when we just want the probability
+    root[0] = BufLen(ev->progs[i].nodes) - 1;
+    if (!outCombos && CubeConfigHistEval(c, &ev->progs[i], root, &p[i])) {
+#ifdef CUBECALC_DEBUG
+      puts("");
+      puts("# combos");
+      puts("(calculated from the histogram)");
+#endif
+      continue;
+    }
+    if (!outCombos && WantEvalDP(&c->lines, c->ranges, c->slotProbs, &ev->progs[i], root,
+          c->forbidden, c->multiplier, &p[i]))
+    {
+#ifdef CUBECALC_DEBUG
+      puts("");
+      puts("# combos");
+      puts("(calculated without enumerating combos)");
+#endif
+      continue;
+    }
+    *BufAlloc(&ev->roots) = WantProgMerge(&ev->merged, &ev->progs[i]);
+    *BufAlloc(&ev->pending) = i;
+  }
+  BufFree(&root);
+
+  if (BufLen(ev->pending)) {
+    if (outCombos) {
+      (void)BufReserveZero(&ev->combos, BufLen(ev->pending));
+    }
+    WantEvalBegin(&ev->e, &c->lines, c->ranges, c->slotProbs, c->primeMul, &ev->merged,
+      ev->roots, c->forbidden, ev->combos, 0);
+  }
+}
+
+// store the results of the wants that went through the combos and free ev
+static
+void CubeConfigEvalEnd(CubeConfigEval* ev, CubeConfig const* c, float* p, Combos* outCombos) {
+  float* pendingP = 0;
+  size_t* numCombos = 0;
+
+  size_t numPending = BufLen(ev->pending);
+  if (numPending) {
+    (void)BufReserveZero(&pendingP, numPending);
+    (void)BufReserveZero(&numCombos, numPending);
+    WantEvalEnd(&ev->e, c->multiplier, pendingP, numCombos);
+    RangeBefore(numPending, j) {
+      p[ev->pending[j]] = pendingP[j];
+      if (outCombos) {
+        CombosInit(&ev->combos[j], &c->lines, c->primeMul, c->lines.comboSize);
+        outCombos[ev->pending[j]] = ev->combos[j];
+      }
+#ifdef CUBECALC_DEBUG
+      puts("");
+      puts("# combos");
+#ifdef CUBECALC_PRINTCOMBOS
+      if (outCombos) {
+        CombosPrint(&ev->combos[j]);
+      }
+#endif
+      printf("%zu total combos\n", numCombos[j]);
+#endif
+    }
+  }
+
+  BufEach(WantProg, ev->progs, prog) {
+    WantProgFree(prog);
+  }
+  BufFree(&ev->progs);
+  WantProgFree(&ev->merged);
+  BufFree(&ev->roots);
+  BufFree(&ev->pending);
+  BufFree(&ev->combos);
+  BufFree(&pendingP);
+  BufFree(&numCombos);
+}
+
+// ok[i] is set to 0 if wantBufs[i] is invalid, the other wants are still calculated
+static
+void CubeConfigCalcEach(CubeConfig const* c, Want const* const* wantBufs, size_t n, float* p,
+  Combos* outCombos, int* ok)
+{
+  CubeConfigEval ev;
+  CubeConfigEvalBegin(&ev, c, wantBufs, n, p, outCombos, ok);
+  if (BufLen(ev.pending)) {
+    WantEvalRun(&ev.e, c->ctx->parallelFor, 0);
+  }
+  CubeConfigEvalEnd(&ev, c, p, outCombos);
+}
+
+int CubeConfigCalcBatch(CubeConfig const* c, Want const* const* wantBufs, size_t n, float* p,
+  Combos* outCombos)
+{
+  int res = 1;
+  int* ok = 0;
+  (void)BufReserve(&ok, n);
+  CubeConfigCalcEach(c, wantBufs, n, p, outCombos, ok);
+  BufEach(int, ok, x) {
+    res &= *x;
+  }
+  BufFree(&ok);
+  return res;
+}
+
+int CubeConfigCalc(CubeConfig const* c, Want const* wantBuf, float* p, Combos* outCombos) {
+  return CubeConfigCalcBatch(c, &wantBuf, 1, p, outCombos);
+}
+
+typedef struct _CombosGroupOrder {
+  float prob;
+  intmax_t i;
+} CombosGroupOrder;
+
+// most likely first, ties in the order they were found
+static
+int CombosGroupCmp(void const* pa, void const* pb) {
+  CombosGroupOrder const* a = pa;
+  CombosGroupOrder const* b = pb;
+  if (a->prob != b->prob) {
+    return a->prob < b->prob ? 1 : -1;
+  }
+  return a->i < b->i ? -1 : a->i > b->i;
+}
+
+// sort the groups of c from most to least likely and keep the first k
+static
+void CombosGroupSort(Combos* c, size_t k) {
+  CombosGroupOrder* order = 0;
+  uint8_t* index = 0;
+  float* groupProb = 0;
+  uint32_t* groupPerms = 0;
+  BufEachi(c->groupProb, i) {
+    *BufAlloc(&order) = (CombosGroupOrder){ .prob = c->groupProb[i], .i = i };
+  }
+  if (order) {
+    qsort(order, BufLen(order), sizeof(order[0]), CombosGroupCmp);
+  }
+  BufEach(CombosGroupOrder, order, o) {
+    if (BufLen(groupProb) >= k) {
+      break;
+    }
+    RangeBefore(c->comboSize, j) {
+      *BufAlloc(&index) = c->index[o->i * c->comboSize + j];
+    }
+    *BufAlloc(&groupProb) = c->groupProb[o->i];
+    *BufAlloc(&groupPerms) = c->groupPerms[o->i];
+  }
+  BufFree(&c->index);
+  BufFree(&c->groupProb);
+  BufFree(&c->groupPerms);
+  c->index = index;
+  c->groupProb = groupProb;
+  c->groupPerms = groupPerms;
+  BufFree(&order);
+}
+
+// CubeConfigCalcTop and CubeConfigCalcGrouped split in begin, run and end like WantEval, so
+// CubeCalcTask can spread them over several steps. top searches for the k best combos first,
+// then counts every match with a WantEval pass if there's more. grouped is a single WantEval
+// pass. *pnum is the total number of combos for top and of groups for grouped
+typedef struct _CubeConfigSearch {
+  CubeConfig const* c;
+  WantProg prog;
+  int* roots;
+  int grouped;
+  size_t k;
+  Combos* out;
+  size_t* pnum;
+  WantTopData top;
+  int topDone;
+  WantEvalData e;
+  int eval; // e has been set up
+  size_t numCombos;
+} CubeConfigSearch;
+
+// returns 0 if wantBuf is invalid, s doesn't need to be ended then
+static
+int CubeConfigSearchBegin(CubeConfigSearch* s, CubeConfig const* c, Want const* wantBuf,
+  int grouped, size_t k, Combos* out, size_t* pnum)
+{
+  int maskHi, maskLo;
+  *s = (CubeConfigSearch){
+    .c = c,
+    .grouped = grouped,
+    .k = k,
+    .out = out,
+    .pnum = pnum,
+  };
+  *out = (Combos){ .comboSize = c->lines.comboSize };
+  *pnum = 0;
+  WantMask(wantBuf, &maskHi, &maskLo);
+  if ((maskHi & ~c->maskHi) || (maskLo & ~c->maskLo)) {
+    fprintf(stderr, "want mentions stats that are not in the configuration\n");
+    return 0;
+  }
+  if (!WantCompile(wantBuf, &s->prog)) {
+    return 0;
+  }
+  *BufAlloc(&s->roots) = BufLen(s->prog.nodes) - 1;
+  if (grouped) {
+    WantEvalBegin(&s->e, &c->lines, c->ranges, c->slotProbs, c->primeMul, &s->prog, s->roots,
+      c->forbidden, out, 1);
+    s->eval = 1;
+  } else {
+    WantTopBegin(&s->top, &c->lines, c->ranges, c->slotProbs, &s->prog, s->roots[0],
+      c->forbidden, k, out);
+  }
+  return 1;
+}
+
+// returns non-zero once the search is over, see WantEvalRun for deadline
+static
+int CubeConfigSearchRun(CubeConfigSearch* s, intmax_t const* deadline) {
+  CubeConfig const* c = s->c;
+  if (!s->grouped && !s->topDone) {
+    if (!WantTopRun(&s->top, deadline)) {
+      return 0;
+    }
+    s->topDone = 1;
+    if (!s->top.more) {
+      s->numCombos = BufLen(s->out->index) / c->lines.comboSize;
+      return 1;
+    }
+    // only counting, so the combos are walked as multisets
+    WantEvalBegin(&s->e, &c->lines, c->ranges, c->slotProbs, c->primeMul, &s->prog, s->roots,
+      c->forbidden, 0, 0);
+    s->eval = 1;
+    if (deadline && CubeClockNs() >= *deadline) {
+      return 0;
+    }
+  }
+  return !s->eval || WantEvalRun(&s->e, c->ctx->parallelFor, deadline);
+}
+
+// store the results and free s. if the search is not over, out is left empty
+static
+void CubeConfigSearchEnd(CubeConfigSearch* s, int done) {
+  CubeConfig const* c = s->c;
+  if (s->eval) {
+    float p;
+    WantEvalEnd(&s->e, c->multiplier, &p, &s->numCombos);
+  }
+  if (!s->grouped) {
+    WantTopEnd(&s->top);
+  }
+  if (!done) {
+    CombosFree(s->out);
+    *s->out = (Combos){ .comboSize = c->lines.comboSize };
+  } else if (s->grouped) {
+    *s->pnum = BufLen(s->out->groupProb);
+    CombosGroupSort(s->out, s->k);
+    CombosInit(s->out, &c->lines, c->primeMul, c->lines.comboSize);
+  } else {
+    *s->pnum = s->numCombos;
+    CombosInit(s->out, &c->lines, c->primeMul, c->lines.comboSize);
+  }
+#ifdef CUBECALC_DEBUG
+  if (done) {
+    puts("");
+    if (s->grouped) {
+      puts("# grouped combos");
+      printf("%zu groups of %zu combos\n", *s->pnum, s->numCombos);
+    } else {
+      puts("# top combos");
+      printf("%zu of %zu combos\n", CombosNum(s->out), *s->pnum);
+    }
+#ifdef CUBECALC_PRINTCOMBOS
+    CombosPrint(s->out);
+#endif
+  }
+#endif
+  WantProgFree(&s->prog);
+  BufFree(&s->roots);
+}
+
+static
+int CubeConfigSearchCalc(CubeConfig const* c, Want const* wantBuf, int grouped, size_t k,
+  Combos* out, size_t* pnum)
+{
+  CubeConfigSearch s;
+  if (!CubeConfigSearchBegin(&s, c, wantBuf, grouped, k, out, pnum)) {
+    return 0;
+  }
+  CubeConfigSearchRun(&s, 0);
+  CubeConfigSearchEnd(&s, 1);
+  return 1;
+}
+
+int CubeConfigCalcTop(CubeConfig const* c, Want const* wantBuf, size_t k, Combos* outCombos,
+  size_t* pnumCombos)
+{
+  return CubeConfigSearchCalc(c, wantBuf, 0, k, outCombos, pnumCombos);
+}
+
+int CubeConfigCalcGrouped(CubeConfig const* c, Want const* wantBuf, size_t k, Combos* outCombos,
+  size_t* pnumGroups)
+{
+  return CubeConfigSearchCalc(c, wantBuf, 1, k, outCombos, pnumGroups);
+}
+
+//
+// CubeCalcTask
+//
+// CubeCalcBatch as a state machine. wants that were not cached are taken in batches that share
+// a configuration. the combos of each batch are walked in chunks (the lines of the first slot),
+// which is where a step can stop and be resumed later. the other kinds of task keep their own
+// state and are ran through run and end instead
+//
+
+// work until deadline like WantEvalRun and return non-zero once done
+typedef int CubeTaskRunFunc(void* state, intmax_t const* deadline);
+
+// store the results if done, free state and return what the blocking version returns
+typedef int CubeTaskEndFunc(void* state, int done);
+
+struct _CubeCalcTask {
+  Want const* const* wantBufs;
+  size_t n;
+  Category category;
+  Cube cube;
+  Tier tier;
+  size_t group;
+  int region; // see CubeRuleRegion
+  float* results;
+  Combos* outCombos;
+  int res;
+  CubeCacheKey* keys;
+  intmax_t* todo; // wants that still have to be calculated
+
+  CubeContext* ctx;
+
+  // the batch being calculated
+  CubeConfig* c;
+  Want const** batch;
+  intmax_t* batchIdx;
+  float* batchP;
+  Combos* batchCombos;
+  int* ok;
+  CubeConfigEval ev;
+
+  // the other kinds of task
+  void* state;
+  CubeTaskRunFunc* run;
+  CubeTaskEndFunc* end;
+  int done;
+};
+
+static
+CubeCalcTask* CubeCalcTaskNew(CubeContext* ctx, void* state, CubeTaskRunFunc* run,
+  CubeTaskEndFunc* end)
+{
+  CubeCalcTask* t = malloc(sizeof(CubeCalcTask));
+  MemZero(t);
+  t->ctx = ctx;
+  t->state = state;
+  t->run = run;
+  t->end = end;
+  return t;
+}
+
+CubeCalcTask* CubeCalcStart(
+  CubeContext* ctx,
+  Want const* const* wantBufs,
+  size_t n,
+  Category category,
+  Cube cube,
+  Tier tier,
+  int lvl,
+  Region region,
+  float* results,
+  Combos* outCombos
+) {
+  CubeCalcTask* t = malloc(sizeof(CubeCalcTask));
+  MemZero(t);
+  t->ctx = ctx;
+  t->wantBufs = wantBufs;
+  t->n = n;
+  t->category = category;
+  t->cube = cube;
+  t->tier = tier;
+  t->group = ValueGroupFind(ctx, cube, category, region, lvl);
+  t->region = CubeRuleRegion(ctx, region);
+  t->results = results;
+  t->outCombos = outCombos;
+  t->res = 1;
+
+  (void)BufReserve(&t->keys, n);
+  RangeBefore(n, i) {
+#ifdef CUBECALC_DEBUG
+    puts("");
+    puts("# want");
+    WantPrint(wantBufs[i]);
+#endif
+    t->keys[i] = CubeCacheKeyInit(wantBufs[i], category, cube, tier, t->group, t->region);
+    if (CubeCacheGet(ctx, &t->keys[i], &results[i], outCombos ? &outCombos[i] : 0)) {
+#ifdef CUBECALC_DEBUG
+      puts("");
+      puts("(cached)");
+#endif
+    } else {
+      *BufAlloc(&t->todo) = i;
+    }
+  }
+  return t;
+}
+
+// take the wants that mention the same stats as the first one in todo and start calculating
+// them. wants with different stats are not merged into a bigger configuration because that would
+// change which lines are folded into ANY, and with that how the forbidden rules apply
+static
+void CubeCalcTaskNext(CubeCalcTask* t) {
+  intmax_t* rest = 0;
+  int maskHi, maskLo;
+  WantMask(t->wantBufs[t->todo[0]], &maskHi, &maskLo);
+  BufEach(intmax_t, t->todo, i) {
+    int hi, lo;
+    WantMask(t->wantBufs[*i], &hi, &lo);
+    if (hi == maskHi && lo == maskLo) {
+      *BufAlloc(&t->batch) = t->wantBufs[*i];
+      *BufAlloc(&t->batchIdx) = *i;
+    } else {
+      *BufAlloc(&rest) = *i;
+    }
+  }
+  BufFree(&t->todo);
+  t->todo = rest;
+
+  size_t numBatch = BufLen(t->batch);
+  (void)BufReserveZero(&t->batchP, numBatch);
+  (void)BufReserveZero(&t->batchCombos, numBatch);
+  (void)BufReserveZero(&t->ok, numBatch);
+  t->c = CubeConfigGetGroup(t->ctx, t->category, t->cube, t->tier, t->group, t->region, maskHi,
+    maskLo);
+  if (t->c) {
+    CubeConfigEvalBegin(&t->ev, t->c, t->batch, numBatch, t->batchP,
+      t->outCombos ? t->batchCombos : 0, t->ok);
+  }
+}
+
+// store the results of the current batch once its combos have been walked
+static
+void CubeCalcTaskFinish(CubeCalcTask* t) {
+  Combos* batchCombos = t->outCombos ? t->batchCombos : 0;
+  if (t->c) {
+    CubeConfigEvalEnd(&t->ev, t->c, t->batchP, batchCombos);
+  }
+  CubeConfigRelease(t->c);
+  t->c = 0;
+
+  BufEachi(t->batchIdx, j) {
+    intmax_t i = t->batchIdx[j];
+    t->results[i] = t->batchP[j];
+    if (batchCombos) {
+      t->outCombos[i] = batchCombos[j];
+    }
+    if (t->ok[j]) {
+      CubeCachePut(t->ctx, &t->keys[i], t->results[i], batchCombos ? &t->outCombos[i] : 0);
+    } else {
+      t->res = 0;
+    }
+  }
+  BufClear(t->batch);
+  BufClear(t->batchIdx);
+  BufClear(t->batchP);
+  BufClear(t->batchCombos);
+  BufClear(t->ok);
+}
+
+// CubeCalcStep with a deadline instead of a budget, so tasks can run other tasks
+static
+int CubeCalcTaskRun(CubeCalcTask* t, intmax_t const* deadline) {
+  if (t->run) {
+    t->done = t->done || t->run(t->state, deadline);
+    return t->done;
+  }
+  while (BufLen(t->batch) || BufLen(t->todo)) {
+    if (!BufLen(t->batch)) {
+      CubeCalcTaskNext(t);
+    }
+    if (!t->c || !BufLen(t->ev.pending) || WantEvalRun(&t->ev.e, t->ctx->parallelFor, deadline)) {
+      CubeCalcTaskFinish(t);
+    }
+    if (deadline && CubeClockNs() >= *deadline) {
+      break;
+    }
+  }
+  return !BufLen(t->batch) && !BufLen(t->todo);
+}
+
+intmax_t CubeClockNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (intmax_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int CubeCalcStep(CubeCalcTask* t, long budgetNs) {
+  intmax_t deadline = CubeClockNs() + budgetNs;
+  return CubeCalcTaskRun(t, budgetNs > 0 ? &deadline : 0);
+}
+
+int CubeCalcTaskFree(CubeCalcTask* t) {
+  if (t->run) {
+    int res = t->end(t->state, t->done);
+    free(t);
+    return res;
+  }
+  int res = t->res;
+  if (BufLen(t->batch)) {
+    // cancelled halfway through a batch, its results are not stored
+    if (t->c) {
+      CubeConfigEvalEnd(&t->ev, t->c, t->batchP, t->outCombos ? t->batchCombos : 0);
+    }
+    CubeConfigRelease(t->c);
+    BufEach(Combos, t->batchCombos, c) {
+      CombosFree(c);
+    }
+  }
+  if (BufLen(t->batch) || BufLen(t->todo)) {
+    res = 0;
+  }
+  BufFree(&t->keys);
+  BufFree(&t->todo);
+  BufFree(&t->batch);
+  BufFree(&t->batchIdx);
+  BufFree(&t->batchP);
+  BufFree(&t->batchCombos);
+  BufFree(&t->ok);
+  free(t);
+  return res;
+}
+
+int CubeCalcBatch(
+  CubeContext* ctx,
+  Want const* const* wantBufs,
+  size_t n,
+  Category category,
+  Cube cube,
+  Tier tier,
+  int lvl,
+  Region region,
+  float* results,
+  Combos* outCombos
+) {
+  CubeCalcTask* t = CubeCalcStart(ctx, wantBufs, n, category, cube, tier, lvl, region, results,
+    outCombos);
+  CubeCalcStep(t, 0);
+  return CubeCalcTaskFree(t);
+}
+
+float CubeCalc(
+  CubeContext* ctx,
+  Want const* wantBuf,
+  Category category,
+  Cube cube,
+  Tier tier,
+  int lvl,
+  Region region,
+  Combos* outCombos
+) {
+  float res = 0;
+  CubeCalcBatch(ctx, &wantBuf, 1, category, cube, tier, lvl, region, &res, outCombos);
+  return res;
+}
+
+// CubeCalcTop and CubeCalcGrouped, see CubeConfigSearch
+typedef struct _CubeSearchTask {
+  CubeConfig* c;
+  CubeConfigSearch search;
+  int ok;
+} CubeSearchTask;
+
+static
+int CubeSearchTaskRun(void* state, intmax_t const* deadline) {
+  CubeSearchTask* st = state;
+  return !st->ok || CubeConfigSearchRun(&st->search, deadline);
+}
+
+static
+int CubeSearchTaskEnd(void* state, int done) {
+  CubeSearchTask* st = state;
+  if (st->ok) {
+    CubeConfigSearchEnd(&st->search, done);
+  }
+  CubeConfigRelease(st->c);
+  int res = st->ok && done;
+  free(st);
+  return res;
+}
+
+static
+CubeCalcTask* CubeSearchTaskStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube cube, Tier tier, int lvl, Region region, int grouped, size_t k, Combos* out, size_t* pnum)
+{
+  CubeSearchTask* st = malloc(sizeof(CubeSearchTask));
+  MemZero(st);
+  *out = (Combos){0};
+  *pnum = 0;
+  st->c = CubeConfigGet(ctx, category, cube, tier, lvl, region, wantBuf);
+  if (st->c) {
+    st->ok = CubeConfigSearchBegin(&st->search, st->c, wantBuf, grouped, k, out, pnum);
+  }
+  return CubeCalcTaskNew(ctx, st, CubeSearchTaskRun, CubeSearchTaskEnd);
+}
+
+CubeCalcTask* CubeCalcTopStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube cube, Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumCombos)
+{
+  return CubeSearchTaskStart(ctx, wantBuf, category, cube, tier, lvl, region, 0, k, outCombos,
+    pnumCombos);
+}
+
+CubeCalcTask* CubeCalcGroupedStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube cube, Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumGroups)
+{
+  return CubeSearchTaskStart(ctx, wantBuf, category, cube, tier, lvl, region, 1, k, outCombos,
+    pnumGroups);
+}
+
+int CubeCalcTop(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumCombos)
+{
+  CubeCalcTask* t = CubeCalcTopStart(ctx, wantBuf, category, cube, tier, lvl, region, k,
+    outCombos, pnumCombos);
+  CubeCalcStep(t, 0);
+  return CubeCalcTaskFree(t);
+}
+
+int CubeCalcGrouped(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube,
+  Tier tier, int lvl, Region region, size_t k, Combos* outCombos, size_t* pnumGroups)
+{
+  CubeCalcTask* t = CubeCalcGroupedStart(ctx, wantBuf, category, cube, tier, lvl, region, k,
+    outCombos, pnumGroups);
+  CubeCalcStep(t, 0);
+  return CubeCalcTaskFree(t);
+}
+
+//
+// CubeCalcMatrix
+//
+// cells that resolve to the same cube, tier and value group are the same calculation, so each
+// distinct one is calculated once. without a deadline the distinct cells are ran through
+// parallelFor, otherwise they are ran one after the other as a CubeCalcTask each
+//
+
+typedef struct _CubeMatrixCell {
+  Cube cube;
+  Tier tier;
+  Region region;
+  int lvl;
+  size_t group;
+  float p;
+} CubeMatrixCell;
+
+typedef struct _CubeMatrixData {
+  CubeContext* ctx;
+  Want const* want;
+  Category category;
+  CubeMatrixCell* cells;
+  intmax_t* cellOf; // distinct cell for each result, -1 if the item doesn't exist
+  int ok;
+  float** presult;
+
+  // the cell being calculated when running with a deadline
+  size_t nextCell;
+  Want* optimized;
+  Want const* cellWant;
+  CubeCalcTask* cellTask;
+} CubeMatrixData;
+
+// optimize the want for cell i. returns 0 if there's no way to roll it
+static
+int CubeMatrixOptimize(CubeMatrixData const* m, size_t i, Want** pout) {
+  CubeMatrixCell const* c = &m->cells[i];
+  // empty means there's no way to roll this
+  return WantOptimize(m->ctx, m->want, m->category, c->cube, c->tier, c->lvl, c->region,
+    pout) && BufLen(*pout);
+}
+
+static
+void CubeMatrixTask(void* data, size_t i) {
+  CubeMatrixData const* m = data;
+  CubeMatrixCell* c = &m->cells[i];
+  Want* optimized = 0;
+  if (CubeMatrixOptimize(m, i, &optimized)) {
+    c->p = CubeCalc(m->ctx, optimized, m->category, c->cube, c->tier, c->lvl, c->region, 0);
+  }
+  BufFree(&optimized);
+}
+
+static
+int CubeMatrixRun(void* state, intmax_t const* deadline) {
+  CubeMatrixData* m = state;
+  CubeContext* ctx = m->ctx;
+  size_t numCells = BufLen(m->cells);
+  if (!deadline && !m->nextCell && !m->cellTask && numCells > 1 && ctx->parallelFor) {
+    ctx->parallelFor(CubeMatrixTask, m, numCells);
+    m->nextCell = numCells;
+  }
+  while (m->nextCell < numCells) {
+    CubeMatrixCell* c = &m->cells[m->nextCell];
+    if (!m->cellTask) {
+      if (!CubeMatrixOptimize(m, m->nextCell, &m->optimized)) {
+        ++m->nextCell;
+        continue;
+      }
+      m->cellWant = m->optimized;
+      m->cellTask = CubeCalcStart(ctx, &m->cellWant, 1, m->category, c->cube, c->tier, c->lvl,
+        c->region, &c->p, 0);
+    }
+    if (!CubeCalcTaskRun(m->cellTask, deadline)) {
+      return 0;
+    }
+    CubeCalcTaskFree(m->cellTask);
+    m->cellTask = 0;
+    ++m->nextCell;
+    if (deadline && CubeClockNs() >= *deadline) {
+      break;
+    }
+  }
+  return m->nextCell >= numCells;
+}
+
+static
+int CubeMatrixEnd(void* state, int done) {
+  CubeMatrixData* m = state;
+  float* res = 0;
+  if (m->cellTask) {
+    CubeCalcTaskFree(m->cellTask);
+  }
+  if (m->ok && done) {
+    (void)BufReserve(&res, BufLen(m->cellOf));
+    BufEachi(m->cellOf, i) {
+      res[i] = m->cellOf[i] >= 0 ? m->cells[m->cellOf[i]].p : -1;
+    }
+    *m->presult = res;
+  }
+  BufFree(&m->cellOf);
+  BufFree(&m->cells);
+  BufFree(&m->optimized);
+  free(m);
+  return res != 0;
+}
+
+CubeCalcTask* CubeCalcMatrixStart(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube const* cubes, Tier const* tiers, Region const* regions, int const* levels,
+  float** presult)
+{
+  CubeMatrixData* m = malloc(sizeof(CubeMatrixData));
+  *m = (CubeMatrixData){
+    .ctx = ctx,
+    .want = wantBuf,
+    .category = category,
+    .presult = presult,
+  };
+  *presult = 0;
+
+  WantProg prog = {0};
+  m->ok = WantCompile(wantBuf, &prog);
+  WantProgFree(&prog);
+  if (!m->ok) {
+    return CubeCalcTaskNew(ctx, m, CubeMatrixRun, CubeMatrixEnd);
+  }
+
+  BufEach(Cube const, cubes, cube) {
+    BufEach(Tier const, tiers, tier) {
+      BufEach(Region const, regions, region) {
+        BufEach(int const, levels, lvl) {
+          intmax_t* cell = BufAlloc(&m->cellOf);
+          *cell = -1;
+          size_t group = ValueGroupMatch(ctx, *cube, category, *region, *lvl);
+          if (!CubeItemExists(ctx, category, *cube, *tier, group)) {
+            continue;
+          }
+          BufEachi(m->cells, i) {
+            CubeMatrixCell const* c = &m->cells[i];
+            if (c->cube == *cube && c->tier == *tier && c->group == group) {
+              *cell = i;
+              break;
+            }
+          }
+          if (*cell < 0) {
+            *cell = BufLen(m->cells);
+            *BufAlloc(&m->cells) = (CubeMatrixCell){
+              .cube = *cube,
+              .tier = *tier,
+              .region = *region,
+              .lvl = *lvl,
+              .group = group,
+            };
+          }
+        }
+      }
+    }
+  }
+  return CubeCalcTaskNew(ctx, m, CubeMatrixRun, CubeMatrixEnd);
+}
+
+float* CubeCalcMatrix(CubeContext* ctx, Want const* wantBuf, Category category,
+  Cube const* cubes, Tier const* tiers, Region const* regions, int const* levels)
+{
+  float* res = 0;
+  CubeCalcTask* t = CubeCalcMatrixStart(ctx, wantBuf, category, cubes, tiers, regions, levels,
+    &res);
+  CubeCalcStep(t, 0);
+  CubeCalcTaskFree(t);
+  return res;
+}
+
+//
+// CubeCalcSweep
+//
+// every threshold is a root of the same prog, so the combos or states are only walked once.
+// the histogram and dp engines run in a single step, enumerating is split in chunks like
+// CubeCalcBatch
+//
+
+typedef struct _CubeSweepData {
+  CubeContext* ctx;
+  CubeConfig* c;
+  WantProg prog;
+  int* roots;
+  float* res;
+  float** presult;
+  int started;
+  WantEvalData e;
+  int eval; // e has been set up
+} CubeSweepData;
+
+static
+int CubeSweepRun(void* state, intmax_t const* deadline) {
+  CubeSweepData* sw = state;
+  CubeConfig const* c = sw->c;
+  if (!c) {
+    return 1;
+  }
+  if (!sw->started) {
+    sw->started = 1;
+    Lines const* l = &c->lines;
+    if (CubeConfigHistEval(c, &sw->prog, sw->roots, sw->res) ||
+        WantEvalDP(l, c->ranges, c->slotProbs, &sw->prog, sw->roots, c->forbidden,
+          c->multiplier, sw->res))
+    {
+      return 1;
+    }
+    WantEvalBegin(&sw->e, l, c->ranges, c->slotProbs, c->primeMul, &sw->prog, sw->roots,
+      c->forbidden, 0, 0);
+    sw->eval = 1;
+    if (deadline && CubeClockNs() >= *deadline) {
+      return 0;
+    }
+  }
+  return !sw->eval || WantEvalRun(&sw->e, sw->ctx->parallelFor, deadline);
+}
+
+static
+int CubeSweepEnd(void* state, int done) {
+  CubeSweepData* sw = state;
+  int res = sw->c && done;
+  if (sw->eval) {
+    size_t* numCombos = 0;
+    (void)BufReserveZero(&numCombos, BufLen(sw->roots));
+    WantEvalEnd(&sw->e, sw->c->multiplier, sw->res, numCombos);
+    BufFree(&numCombos);
+  }
+  if (res) {
+    *sw->presult = sw->res;
+  } else {
+    BufFree(&sw->res);
+  }
+  CubeConfigRelease(sw->c);
+  WantProgFree(&sw->prog);
+  BufFree(&sw->roots);
+  free(sw);
+  return res;
+}
+
+CubeCalcTask* CubeCalcSweepStart(CubeContext* ctx, int lineHi, int lineLo, Category category,
+  Cube cube, Tier tier, int lvl, Region region, float** presult)
+{
+  CubeSweepData* sw = malloc(sizeof(CubeSweepData));
+  *sw = (CubeSweepData){ .ctx = ctx, .presult = presult };
+  *presult = 0;
+
+  size_t group = ValueGroupFind(ctx, cube, category, region, lvl);
+  CubeConfig* c = CubeConfigGetGroup(ctx, category, cube, tier, group,
+    CubeRuleRegion(ctx, region), lineHi, lineLo);
+  sw->c = c;
+  if (!c) {
+    return CubeCalcTaskNew(ctx, sw, CubeSweepRun, CubeSweepEnd);
+  }
+
+  // highest amount any combo can reach, ignoring the forbidden rules
+  Lines const* l = &c->lines;
+  int max = 0;
+  RangeBefore(l->comboSize, slot) {
+    int best = 0;
+    Range(c->ranges[slot * 2], c->ranges[slot * 2 + 1], i) {
+      if (LineMatches(l, i, lineHi, lineLo)) {
+        best = Max(best, l->value[i]);
+      }
+    }
+    max += best;
+  }
+
+  Range(0, max, v) {
+    *BufAlloc(&sw->roots) = WantProgLeaf(&sw->prog, lineHi, lineLo, 0, v);
+  }
+  (void)BufReserve(&sw->res, BufLen(sw->roots));
+  return CubeCalcTaskNew(ctx, sw, CubeSweepRun, CubeSweepEnd);
+}
+
+float* CubeCalcSweep(CubeContext* ctx, int lineHi, int lineLo, Category category, Cube cube,
+  Tier tier, int lvl, Region region)
+{
+  float* res = 0;
+  CubeCalcTask* t = CubeCalcSweepStart(ctx, lineHi, lineLo, category, cube, tier, lvl, region,
+    &res);
+  CubeCalcStep(t, 0);
+  CubeCalcTaskFree(t);
+  return res;
+}
+
+//
+// CubeSim
+//
+// each slot samples its range from an alias table (Vose), so a draw is one random number no
+// matter how many lines there are. when the chances of a slot add up to less than 1, the rest
+// goes to an extra entry with line -1 that makes the roll fail
+//
+
+// rolls per block. blocks are the unit of work for the parallel for and are summed in order
+#define CUBE_SIM_BLOCK (1 << 16)
+
+typedef struct _CubeSimData {
+  CubeConfig const* c;
+  WantProg prog;
+  int* contrib;        // what each line adds to each accumulator
+  uint32_t* lineRules; // same as WantEval
+  size_t width;        // entries per slot in the tables below
+  int* line;
+  float* cut;          // alias tables
+  int* alias;
+  double* weight;      // probability / sampling probability of each entry
+  size_t rolls;
+  uint64_t seed;
+  double* sums;        // for each block, sum of the weights and the squared weights of the hits
+  double* sumsSq;
+  size_t* hits;
+} CubeSimData;
+
+// splitmix64 of the counter, each draw of each roll gets its own counter
+static
+uint64_t CubeSimRand(uint64_t seed, uint64_t counter) {
+  uint64_t z = seed + counter * 0x9e3779b97f4a7c15;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// build the alias table for the n probabilities in p (which add up to 1)
+static
+void CubeSimAlias(double const* p, size_t n, float* cut, int* alias) {
+  double* scaled = 0;
+  intmax_t* small = 0;
+  intmax_t* large = 0;
+  RangeBefore(n, i) {
+    *BufAlloc(&scaled) = p[i] * n;
+    *BufAlloc(scaled[i] < 1 ? &small : &large) = i;
+  }
+  while (BufLen(small) && BufLen(large)) {
+    intmax_t s = BufAt(small, -1);
+    intmax_t l = BufAt(large, -1);
+    BufDel(small, -1);
+    cut[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      BufDel(large, -1);
+      *BufAlloc(&small) = l;
+    }
+  }
+  // whatever is left is 1 give or take rounding errors
+  BufEach(intmax_t, small, i) {
+    cut[*i] = 1;
+    alias[*i] = *i;
+  }
+  BufEach(intmax_t, large, i) {
+    cut[*i] = 1;
+    alias[*i] = *i;
+  }
+  BufFree(&scaled);
+  BufFree(&small);
+  BufFree(&large);
+}
+
+static
+void CubeSimBlock(void* data, size_t block) {
+  CubeSimData* e = data;
+  CubeConfig const* c = e->c;
+  WantProg const* prog = &e->prog;
+  size_t comboSize = c->lines.comboSize;
+  size_t numAccs = BufLen(prog->accs);
+  size_t numForbidden = BufLen(c->forbidden);
+
+  int* acc = 0;
+  int* counts = 0;
+  int* zeros = 0;
+  uint64_t* bits = 0;
+  uint64_t* done = 0;
+  (void)BufReserve(&acc, numAccs);
+  (void)BufReserve(&counts, numForbidden);
+  (void)BufReserveZero(&zeros, numAccs * KERNEL_PAD(1));
+  (void)BufReserve(&bits, BufLen(prog->tests));
+  (void)BufReserve(&done, ArrayBitElements(done, BufLen(prog->tests)));
+  WantLanes lanes = {
+    .prefix = acc,
+    .cols = zeros,
+    .stride = KERNEL_PAD(1),
+    .n = 1,
+    .bits = bits,
+    .done = done,
+  };
+
+  double sum = 0, sumSq = 0;
+  size_t hits = 0;
+  size_t first = block * CUBE_SIM_BLOCK;
+  size_t end = Min(e->rolls, first + CUBE_SIM_BLOCK);
+  for (size_t roll = first; roll < end; ++roll) {
+    double w = 1;
+    BufZero(acc);
+    BufZero(counts);
+    RangeBefore(comboSize, slot) {
+      uint64_t r = CubeSimRand(e->seed, (uint64_t)roll * comboSize + slot);
+      size_t k = ((r >> 32) * e->width) >> 32;
+      float u = (r & 0xffffffff) * (1.0f / 4294967296.0f);
+      size_t entry = slot * e->width + (u < e->cut[slot * e->width + k] ? k :
+        (size_t)e->alias[slot * e->width + k]);
+      int i = e->line[entry];
+      if (i < 0) {
+        goto nextRoll;
+      }
+      w *= e->weight[entry];
+      RangeBefore(numAccs, a) {
+        acc[a] += e->contrib[i * numAccs + a];
+      }
+      RangeBefore(numForbidden, f) {
+        if (((e->lineRules[i] >> f) & 1) && ++counts[f] >= c->forbidden[f].value) {
+          goto nextRoll;
+        }
+      }
+    }
+    BufZero(done);
+    if (WantProgEval(prog, &lanes, BufLen(prog->nodes) - 1, 1)) {
+      sum += w;
+      sumSq += w * w;
+      ++hits;
+    }
+nextRoll:;
+  }
+  e->sums[block] = sum;
+  e->sumsSq[block] = sumSq;
+  e->hits[block] = hits;
+
+  BufFree(&acc);
+  BufFree(&counts);
+  BufFree(&zeros);
+  BufFree(&bits);
+  BufFree(&done);
+}
+
+int CubeSim(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier tier,
+  int lvl, Region region, size_t rolls, uint64_t seed, int importance, CubeSimResult* out)
+{
+  int res = 0;
+  double* p = 0;
+  double* q = 0;
+  CubeSimData e = {
+    .rolls = rolls,
+    .seed = CubeSimRand(seed, 0),
+  };
+
+  MemZero(out);
+  out->rolls = rolls;
+  CubeConfig* c = CubeConfigGet(ctx, category, cube, tier, lvl, region, wantBuf);
+  if (!c || !rolls || !WantCompile(wantBuf, &e.prog)) {
+    goto cleanup;
+  }
+  e.c = c;
+
+  Lines const* l = &c->lines;
+  size_t numLines = BufLen(l->lineHi);
+  size_t numAccs = BufLen(e.prog.accs);
+  size_t comboSize = l->comboSize;
+  WantContribInit(l, e.prog.accs, c->forbidden, &e.contrib, &e.lineRules);
+
+  // every slot gets the same number of entries so the tables are easy to index. unused entries
+  // have no chance of being picked
+  RangeBefore(comboSize, slot) {
+    e.width = Max(e.width, (size_t)(c->ranges[slot * 2 + 1] - c->ranges[slot * 2] + 2));
+  }
+  (void)BufReserve(&e.line, comboSize * e.width);
+  (void)BufReserve(&e.cut, comboSize * e.width);
+  (void)BufReserve(&e.alias, comboSize * e.width);
+  (void)BufReserve(&e.weight, comboSize * e.width);
+  (void)BufReserve(&p, e.width);
+  (void)BufReserve(&q, e.width);
+  RangeBefore(comboSize, slot) {
+    size_t base = slot * e.width;
+    double total = 0, favored = 0;
+    BufZero(p);
+    RangeBefore(e.width, k) {
+      e.line[base + k] = -1;
+    }
+    Range(c->ranges[slot * 2], c->ranges[slot * 2 + 1], i) {
+      size_t k = i - c->ranges[slot * 2];
+      e.line[base + k] = i;
+      p[k] = c->slotProbs[slot * numLines + i];
+      total += p[k];
+      RangeBefore(numAccs, a) {
+        if (e.contrib[i * numAccs + a]) {
+          favored += p[k];
+          break;
+        }
+      }
+    }
+    // the chance of rolling nothing valid goes to the last entry, which is always unused
+    p[e.width - 1] = Max(0, 1 - total);
+    total = Max(total, 1);
+    RangeBefore(e.width, k) {
+      p[k] /= total;
+    }
+
+    // half the time pick among the lines that count towards the want, in proportion to their
+    // chance. no weight goes over 2 so this can't do much worse than not favoring anything
+    favored /= total;
+    RangeBefore(e.width, k) {
+      int i = e.line[base + k];
+      int counts = 0;
+      RangeBefore(numAccs, a) {
+        counts |= i >= 0 && e.contrib[i * numAccs + a];
+      }
+      q[k] = importance && favored > 0 ? p[k] / 2 + (counts ? p[k] / favored / 2 : 0) : p[k];
+      e.weight[base + k] = q[k] > 0 ? p[k] / q[k] : 0;
+    }
+    CubeSimAlias(q, e.width, &e.cut[base], &e.alias[base]);
+  }
+
+  size_t numBlocks = (rolls + CUBE_SIM_BLOCK - 1) / CUBE_SIM_BLOCK;
+  (void)BufReserveZero(&e.sums, numBlocks);
+  (void)BufReserveZero(&e.sumsSq, numBlocks);
+  (void)BufReserveZero(&e.hits, numBlocks);
+  if (numBlocks > 1 && ctx->parallelFor) {
+    ctx->parallelFor(CubeSimBlock, &e, numBlocks);
+  } else {
+    RangeBefore(numBlocks, i) {
+      CubeSimBlock(&e, i);
+    }
+  }
+
+  double sum = 0, sumSq = 0;
+  RangeBefore(numBlocks, i) {
+    sum += e.sums[i];
+    sumSq += e.sumsSq[i];
+    out->hits += e.hits[i];
+  }
+
+  double n = rolls;
+  double z = 1.96;
+  if (importance) {
+    // normal approximation on the weighted hits
+    double mean = sum / n;
+    double var = Max(0, sumSq / n - mean * mean);
+    double half = z * sqrt(var / n);
+    out->p = mean;
+    out->lo = Max(0, mean - half);
+    out->hi = mean + half;
+  } else {
+    // wilson score interval, still sensible when there are few or no hits
+    double h = out->hits;
+    double center = (h + z * z / 2) / (n + z * z);
+    double half = z * sqrt(h * (n - h) / n + z * z / 4) / (n + z * z);
+    out->p = h / n;
+    out->lo = Max(0, center - half);
+    out->hi = Min(1, center + half);
+  }
+  out->p *= c->multiplier;
+  out->lo *= c->multiplier;
+  out->hi *= c->multiplier;
+  res = 1;
+
+cleanup:
+  CubeConfigRelease(c);
+  WantProgFree(&e.prog);
+  BufFree(&e.contrib);
+  BufFree(&e.lineRules);
+  BufFree(&e.line);
+  BufFree(&e.cut);
+  BufFree(&e.alias);
+  BufFree(&e.weight);
+  BufFree(&e.sums);
+  BufFree(&e.sumsSq);
+  BufFree(&e.hits);
+  BufFree(&p);
+  BufFree(&q);
+  if (res) {
+    out->exact = CubeCalc(ctx, wantBuf, category, cube, tier, lvl, region, 0);
+  }
+  return res;
+}
+
+//
+// CubePlan
+//
+// the transient states are the tiers from plan->from up to the highest tier the item can tier up
+// to. a cube used at tier t either misses and stays at t (chance s), misses after tiering up
+// (chance a) or rolls the target. with N_t the number of cubes left from tier t:
+//
+//   E[N_t]   = 1 + s E[N_t] + a E[N_t+1]
+//   E[N_t^2] = 1 + 2 (s E[N_t] + a E[N_t+1]) + s E[N_t^2] + a E[N_t+1^2]
+//
+// which are solved from the top tier down. quantiles don't have a closed form, they come from
+// the transition matrix raised to powers of two
+//
+
+// highest tier the plan can tier up to
+static
+int CubePlanTop(CubePlan const* plan) {
+  int top = plan->from;
+  while (top < LEGENDARY && plan->tierUp[top] > 0) {
+    ++top;
+  }
+  return top;
+}
+
+// chance of missing and staying at t (*s) and of missing after tiering up (*a)
+static
+void CubePlanStep(CubePlan const* plan, int t, int top, double* s, double* a) {
+  double up = t < top ? plan->tierUp[t] : 0;
+  double hit = t >= (int)plan->target ? plan->p[t] : 0;
+  double hitUp = t < top && t + 1 >= (int)plan->target ? plan->p[t + 1] : 0;
+  *s = (1 - up) * (1 - hit);
+  *a = up * (1 - hitUp);
+}
+
+static
+int CubePlanValid(CubePlan const* plan) {
+  if (plan->from < BASE || plan->from > LEGENDARY ||
+      plan->target < BASE || plan->target > LEGENDARY)
+  {
+    fprintf(stderr, "invalid plan tiers %d -> %d\n", plan->from, plan->target);
+    return 0;
+  }
+  RangeBefore(CUBE_NUM_TIERS, t) {
+    if (!(plan->p[t] >= 0 && plan->p[t] <= 1 && plan->tierUp[t] >= 0 && plan->tierUp[t] <= 1)) {
+      fprintf(stderr, "invalid plan chances at tier %jd\n", t);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int CubePlanSolve(CubePlan* plan) {
+  plan->expected = plan->stddev = 0;
+  if (!CubePlanValid(plan)) {
+    return 0;
+  }
+
+  int top = CubePlanTop(plan);
+  double e = 0, m = 0; // E[N] and E[N^2] of the tier above
+  int stuck = 0;       // the tier above might never reach the target
+  for (int t = top; t >= (int)plan->from; --t) {
+    double s, a;
+    CubePlanStep(plan, t, top, &s, &a);
+    stuck = s >= 1 || (a > 0 && stuck);
+    if (stuck) {
+      continue;
+    }
+    double et = (1 + a * e) / (1 - s);
+    m = (1 + 2 * (s * et + a * e) + a * m) / (1 - s);
+    e = et;
+  }
+
+  if (!stuck) {
+    plan->expected = e;
+    plan->stddev = sqrt(Max(0, m - e * e));
+  }
+  return 1;
+}
+
+typedef struct _CubePlanMat {
+  double m[CUBE_NUM_TIERS][CUBE_NUM_TIERS];
+} CubePlanMat;
+
+static
+void CubePlanMatMul(CubePlanMat const* a, CubePlanMat const* b, size_t n, CubePlanMat* out) {
+  MemZero(out);
+  RangeBefore(n, i) {
+    RangeBefore(n, k) {
+      RangeBefore(n, j) {
+        out->m[i][j] += a->m[i][k] * b->m[k][j];
+      }
+    }
+  }
+}
+
+intmax_t CubePlanQuantile(CubePlan const* plan, double percent) {
+  if (plan->expected <= 0 || percent <= 0 || percent >= 100) {
+    return 0;
+  }
+
+  // powers[j] is the transition matrix to the power of 2^j between the tiers from plan->from to
+  // top, without rolling the target. the chance of not being done after n cubes is the sum of
+  // the first row of its n-th power
+  int from = plan->from;
+  size_t n = CubePlanTop(plan) - from + 1;
+  CubePlanMat powers[62];
+  MemZero(&powers[0]);
+  RangeBefore(n, i) {
+    double s, a;
+    CubePlanStep(plan, from + i, from + n - 1, &s, &a);
+    powers[0].m[i][i] = s;
+    if (i + 1 < (intmax_t)n) {
+      powers[0].m[i][i + 1] = a;
+    }
+  }
+
+  // square until 2^j cubes are enough
+  double rest = 1 - percent / 100;
+  size_t numPowers = 1;
+  for (;;) {
+    double left = 0;
+    RangeBefore(n, i) {
+      left += powers[numPowers - 1].m[0][i];
+    }
+    if (left <= rest) {
+      break;
+    }
+    if (numPowers >= ArrayLength(powers)) {
+      return 0;
+    }
+    CubePlanMatMul(&powers[numPowers - 1], &powers[numPowers - 1], n, &powers[numPowers]);
+    ++numPowers;
+  }
+
+  // largest number of cubes that is not enough, one bit at a time
+  double x[CUBE_NUM_TIERS] = { 1 };
+  intmax_t cubes = 0;
+  for (size_t j = numPowers; j-- > 0;) {
+    double y[CUBE_NUM_TIERS] = {0};
+    double left = 0;
+    RangeBefore(n, i) {
+      RangeBefore(n, k) {
+        y[i] += x[k] * powers[j].m[k][i];
+      }
+      left += y[i];
+    }
+    if (left > rest) {
+      memcpy(x, y, sizeof(x));
+      cubes += (intmax_t)1 << j;
+    }
+  }
+  return cubes + 1;
+}
+
+int CubeCalcPlan(CubeContext* ctx, Want const* wantBuf, Category category, Cube cube, Tier from,
+  Tier target, int lvl, Region region, double const* tierUp, CubePlan* out)
+{
+  MemZero(out);
+  out->from = from;
+  out->target = target;
+  if (tierUp) {
+    memcpy(out->tierUp, tierUp, sizeof(out->tierUp));
+  }
+  if (!CubePlanValid(out)) {
+    return 0;
+  }
+
+  int res = 1;
+  Want* optimized = 0;
+  size_t group = ValueGroupFind(ctx, cube, category, region, lvl);
+  for (int t = Max(from, target); t <= CubePlanTop(out); ++t) {
+    if (!CubeItemExists(ctx, category, cube, t, group)) {
+      fprintf(stderr, "cube 0x%x can't roll tier %d on category 0x%x\n", cube, t, category);
+      res = 0;
+      break;
+    }
+    if (!WantOptimize(ctx, wantBuf, category, cube, t, lvl, region, &optimized)) {
+      res = 0;
+      break;
+    }
+    // empty means there's no way to roll this at this tier
+    if (BufLen(optimized)) {
+      out->p[t] = CubeCalc(ctx, optimized, category, cube, t, lvl, region, 0);
+    }
+  }
+  BufFree(&optimized);
+  return res && CubePlanSolve(out);
+}
+
+//
+// CubeCalcStrategies
+//
+// strategies are evaluated as a chain over the tiers like CubePlan, except the cube and its cost
+// depend on the tier. the chance of a cube at a tier is a cell, computed on demand in waves of
+// strategies ordered by their lower bound
+//
+
+// cells a wave computes before its strategies are evaluated
+#define CUBE_STRATEGY_WAVE 16
+
+typedef struct _CubeStrategyCell {
+  int cube; // index into cubes
+  int tier;
+  double p;
+} CubeStrategyCell;
+
+typedef struct _CubeStrategyData {
+  CubeContext* ctx;
+  Want const* want;
+  Category category;
+  int lvl;
+  Region region;
+  CubeStrategyCube const* cubes;
+  CubeStrategyCell* cells;
+} CubeStrategyData;
+
+typedef struct _CubeStrategyCand {
+  int up, roll; // indices into cubes
+  int switchTier;
+  double bound;
+} CubeStrategyCand;
+
+static
+void CubeStrategyTask(void* data, size_t i) {
+  CubeStrategyData const* d = data;
+  CubeStrategyCell* cell = &d->cells[i];
+  Cube cube = d->cubes[cell->cube].cube;
+  Want* optimized = 0;
+  cell->p = 0;
+  // empty means there's no way to roll this
+  if (WantOptimize(d->ctx, d->want, d->category, cube, cell->tier, d->lvl, d->region,
+        &optimized) && BufLen(optimized))
+  {
+    cell->p = CubeCalc(d->ctx, optimized, d->category, cube, cell->tier, d->lvl, d->region, 0);
+  }
+  BufFree(&optimized);
+}
+
+static
+int CubeStrategyCandCmp(void const* pa, void const* pb) {
+  CubeStrategyCand const* a = pa;
+  CubeStrategyCand const* b = pb;
+  return (a->bound > b->bound) - (a->bound < b->bound);
+}
+
+static
+int CubeStrategyCmp(void const* pa, void const* pb) {
+  CubeStrategy const* a = pa;
+  CubeStrategy const* b = pb;
+  return (a->cost > b->cost) - (a->cost < b->cost);
+}
+
+// the cube used at tier t and the highest tier the strategy can reach
+#define CubeStrategyAt(cand, t) ((t) < (cand)->switchTier ? (cand)->up : (cand)->roll)
+
+static
+int CubeStrategyTop(CubeStrategyCand const* cand, CubeStrategyCube const* cubes, int from) {
+  int top = from;
+  while (top < LEGENDARY && cubes[CubeStrategyAt(cand, top)].tierUp[top] > 0) {
+    ++top;
+  }
+  return top;
+}
+
+// call f(cube, tier) for every cell the strategy needs: the cube of each tier rolls at that tier
+// and, when it tiers up, at the tier above
+#define CubeStrategyEachCell(cand, cubes, from, target, f) \
+  for (int t = (from), top = CubeStrategyTop(cand, cubes, from); t <= top; ++t) { \
+    int c = CubeStrategyAt(cand, t); \
+    if (t >= (int)(target)) f(c, t); \
+    if (t < top && t + 1 >= (int)(target)) f(c, t + 1); \
+  }
+
+// expected cost and number of cubes of a strategy once its cells are known, returns 0 if it might
+// never reach the target
+static
+int CubeStrategyEval(CubeStrategyCand const* cand, CubeStrategyCube const* cubes, int from,
+  int target, double const* p, CubeStrategy* out)
+{
+  int top = CubeStrategyTop(cand, cubes, from);
+  double cost = 0, expected = 0; // of the tier above
+  for (int t = top; t >= from; --t) {
+    int c = CubeStrategyAt(cand, t);
+    double up = t < top ? cubes[c].tierUp[t] : 0;
+    double hit = t >= target ? p[c * CUBE_NUM_TIERS + t] : 0;
+    double hitUp = t < top && t + 1 >= target ? p[c * CUBE_NUM_TIERS + t + 1] : 0;
+    double s = (1 - up) * (1 - hit);
+    double a = up * (1 - hitUp);
+    if (s >= 1) {
+      return 0;
+    }
+    cost = (cubes[c].cost + a * cost) / (1 - s);
+    expected = (1 + a * expected) / (1 - s);
+  }
+  *out = (CubeStrategy){
+    .up = cubes[cand->up].cube,
+    .roll = cubes[cand->roll].cube,
+    .switchTier = cand->switchTier,
+    .cost = cost,
+    .expected = expected,
+  };
+  return 1;
+}
+
+CubeStrategy* CubeCalcStrategies(CubeContext* ctx, Want const* wantBuf, Category category,
+  int lvl, Region region, Tier from, Tier target, CubeStrategyCube const* cubes, size_t numCubes,
+  size_t k)
+{
+  CubeStrategy* res = 0;
+  CubeStrategyCand* cands = 0;
+  double* p = 0; // p[cube * CUBE_NUM_TIERS + tier], -1 if not calculated yet
+  int* exists = 0;
+  CubeStrategyData d = {
+    .ctx = ctx,
+    .want = wantBuf,
+    .category = category,
+    .lvl = lvl,
+    .region = region,
+    .cubes = cubes,
+  };
+
+  WantProg prog = {0};
+  if (!WantCompile(wantBuf, &prog)) {
+    return 0;
+  }
+  WantProgFree(&prog);
+  if (from < BASE || from > LEGENDARY || target < BASE || target > LEGENDARY) {
+    fprintf(stderr, "invalid strategy tiers %d -> %d\n", from, target);
+    return 0;
+  }
+
+  (void)BufReserve(&p, numCubes * CUBE_NUM_TIERS);
+  (void)BufReserveZero(&exists, numCubes * CUBE_NUM_TIERS);
+  RangeBefore(numCubes, c) {
+    size_t group = ValueGroupMatch(ctx, cubes[c].cube, category, region, lvl);
+    RangeBefore(CUBE_NUM_TIERS, t) {
+      p[c * CUBE_NUM_TIERS + t] = -1;
+      exists[c * CUBE_NUM_TIERS + t] = t >= BASE &&
+        CubeItemExists(ctx, category, cubes[c].cube, t, group);
+    }
+  }
+
+  // a cube on its own, or tiering up to switchTier with up and rolling the rest with roll.
+  // tiers below both the target and switchTier can't roll the target, the cost of climbing them
+  // is the same for every strategy that goes through them and is the lower bound
+  RangeBefore(numCubes, up) {
+    if (cubes[up].cost <= 0) {
+      continue;
+    }
+    double bound = 0;
+    for (int sw = from; sw <= LEGENDARY; ++sw) {
+      if (sw > (int)from) {
+        double u = cubes[up].tierUp[sw - 1];
+        if (u <= 0 || !exists[up * CUBE_NUM_TIERS + sw - 1]) {
+          break;
+        }
+        if (sw - 1 < (int)target) {
+          bound += cubes[up].cost / u;
+        }
+      }
+      RangeBefore(numCubes, roll) {
+        if (cubes[roll].cost <= 0 || (sw == (int)from) != (roll == up)) {
+          continue;
+        }
+        CubeStrategyCand cand = { .up = up, .roll = roll, .switchTier = sw, .bound = bound };
+        int ok = 1;
+        int top = CubeStrategyTop(&cand, cubes, from);
+        for (int t = sw; t <= top; ++t) {
+          ok &= exists[roll * CUBE_NUM_TIERS + t];
+        }
+        if (ok) {
+          *BufAlloc(&cands) = cand;
+        }
+      }
+    }
+  }
+  if (cands) {
+    qsort(cands, BufLen(cands), sizeof(cands[0]), CubeStrategyCandCmp);
+  }
+
+  // the k-th cheapest cost found so far, strategies whose bound is higher are pruned
+  double threshold = HUGE_VAL;
+  size_t next = 0;
+  while (next < BufLen(cands) && cands[next].bound < threshold) {
+    // take strategies until the wave has enough cells to calculate
+    size_t first = next;
+    BufClear(d.cells);
+    for (; next < BufLen(cands) && cands[next].bound < threshold; ++next) {
+      if (BufLen(d.cells) >= CUBE_STRATEGY_WAVE) {
+        break;
+      }
+#define F(c, t) \
+      if (p[(c) * CUBE_NUM_TIERS + (t)] < 0) { \
+        p[(c) * CUBE_NUM_TIERS + (t)] = 0; \
+        if (exists[(c) * CUBE_NUM_TIERS + (t)]) { \
+          *BufAlloc(&d.cells) = (CubeStrategyCell){ .cube = (c), .tier = (t) }; \
+        } \
+      }
+      CubeStrategyEachCell(&cands[next], cubes, from, target, F)
+#undef F
+    }
+
+    size_t numCells = BufLen(d.cells);
+    if (numCells > 1 && ctx->parallelFor) {
+      ctx->parallelFor(CubeStrategyTask, &d, numCells);
+    } else {
+      RangeBefore(numCells, i) {
+        CubeStrategyTask(&d, i);
+      }
+    }
+    BufEach(CubeStrategyCell, d.cells, cell) {
+      p[cell->cube * CUBE_NUM_TIERS + cell->tier] = cell->p;
+    }
+
+    Range(first, (intmax_t)next - 1, i) {
+      CubeStrategy st;
+      if (CubeStrategyEval(&cands[i], cubes, from, target, p, &st)) {
+        *BufAlloc(&res) = st;
+      }
+    }
+    if (res) {
+      qsort(res, BufLen(res), sizeof(res[0]), CubeStrategyCmp);
+    }
+    if (k && BufLen(res) >= k) {
+      BufHdr(res)->len = k;
+      threshold = res[k - 1].cost;
+    }
+  }
+
+  // an empty table is not a failure, return an allocated Buf with no strategies
+  if (!res) {
+    (void)BufAlloc(&res);
+    BufClear(res);
+  }
+  BufFree(&cands);
+  BufFree(&p);
+  BufFree(&exists);
+  BufFree(&d.cells);
+  return res;
+}
+
+// the generated data lives in globals, contexts created without data share it and the last one
+// frees it. this lock is only taken when creating and freeing contexts
+static CubeMutex cubeGeneratedMutex = CUBE_MUTEX_INITIALIZER;
+static size_t cubeGeneratedRefs;
+static int cubeKernelReady;
+
+CubeContext* CubeContextNew(CubeDataset const* data) {
+  CubeContext* ctx = malloc(sizeof(CubeContext));
+  if (!ctx) {
+    return 0;
+  }
+  MemZero(ctx);
+
+  CubeLock(&cubeGeneratedMutex);
+  if (!cubeKernelReady) {
+    KernelInit();
+    cubeKernelReady = 1;
+  }
+  if (!data && !cubeGeneratedRefs++) {
+    cubecalcGeneratedGlobalInit();
+  }
+  CubeUnlock(&cubeGeneratedMutex);
+
+  if (data) {
+    ctx->data = *data;
+  } else {
+    ctx->builtin = 1;
+    ctx->data = (CubeDataset){
+      .primeChances = primeChances,
+      .kms = kms,
+      .tms = tms,
+      .fams = fams,
+      .famsCard = famsCard,
+      .valueGroups = valueGroups,
+      .valueGroupsLen = valueGroupsLen,
+      .valueGroupsMaxLevel = valueGroupsMaxLevel,
+      .valueGroupsCubeMask = valueGroupsCubeMask,
+      .valueGroupsCategoryMask = valueGroupsCategoryMask,
+      .valueGroupsRegionMask = valueGroupsRegionMask,
+      .lineRules = generatedLineRules,
+      .lineRulesLen = ArrayLength(generatedLineRules),
+    };
+  }
+  DataIndexInit(ctx);
+  ValueGroupIndexInit(ctx);
+  RangeBefore(ctx->data.lineRulesLen, i) {
+    ctx->ruleRegions |= ctx->data.lineRules[i].regions != 0;
+  }
+
+  CubeMutexInit(&ctx->cacheMutex);
+  ctx->cacheStats.budget = CUBE_CACHE_DEFAULT_BUDGET;
+  ctx->cacheKeepCombos = 1;
+  CubeMutexInit(&ctx->valuesMutex);
+  CubeMutexInit(&ctx->configMutex);
+  ctx->histEnable = 1;
+  return ctx;
+}
+
+void CubeContextFree(CubeContext* ctx) {
+  if (!ctx) {
+    return;
+  }
+  CubeCacheClear(ctx);
+  CubeConfigClear(ctx);
+  if (BufLen(ctx->configs)) {
+    fprintf(stderr, "freeing a context with %zu configurations in use\n", BufLen(ctx->configs));
+  }
+  BufFree(&ctx->configs);
+  LinesValuesClear(ctx);
+  BufFree(&ctx->valueGroupIndex);
+  CubeMutexFree(&ctx->cacheMutex);
+  CubeMutexFree(&ctx->valuesMutex);
+  CubeMutexFree(&ctx->configMutex);
+
+  if (ctx->builtin) {
+    CubeLock(&cubeGeneratedMutex);
+    if (!--cubeGeneratedRefs) {
+      cubecalcGeneratedGlobalFree();
+    }
+    CubeUnlock(&cubeGeneratedMutex);
+  }
+  free(ctx);
 }
 
 #endif
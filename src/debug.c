@@ -35,19 +35,25 @@ void DataPrint(LineData const* ld, int tier, int* values) {
 }
 
 static
-void LinesPrint(Lines* l) {
+void CombosPrint(Combos* c) {
   Align* al = AlignInit();
-  BufEachi(l->lineHi, i) {
-    char* s = LineToStr(l->lineHi[i], l->lineLo[i]);
-    if (!(i % l->comboSize)) {
+  BufEachi(c->index, i) {
+    ComboLine const* line = CombosLine(c, i);
+    char* s = LineToStr(LineMaskHi(line->mask), LineMaskLo(line->mask));
+    if (!(i % c->comboSize)) {
       AlignFeed(al, "%s", "", "");
+      if (c->groupProb) {
+        // grouped combos only have the probability of the whole group
+        size_t j = i / c->comboSize;
+        AlignFeed(al, "%u orderings 1", " in %g", c->groupPerms[j], 1 / c->groupProb[j]);
+      }
     }
-    float p = l->onein[i];
-    if (p < 1) {
-      p = 1/p;
+    if (c->groupProb) {
+      AlignFeed(al, "%d %s %s", "", line->value, s, line->prime ? "P" : " ");
+    } else {
+      AlignFeed(al, "%d %s %s 1", " in %g",
+        line->value, s, line->prime ? "P" : " ", 1 / CombosProb(c, i));
     }
-    AlignFeed(al, "%d %s %s 1", " in %g",
-      l->value[i], s, ArrayBit(l->prime, i) ? "P" : " ", p);
     BufFree(&s);
   }
   AlignPrint(al, stdout);
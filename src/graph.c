@@ -31,6 +31,20 @@ enum {
 #define nodeNamesCount (nodeTypes(countEntries)+0)
 extern char* nodeNames[nodeNamesCount];
 
+// what a result node calculates. this is the value of the result's NodeData
+#define resultModes(f) \
+  f(RCOMBOS) \
+  f(RCUBE_MATRIX) \
+  f(RSWEEP) \
+  f(RGROUPED) \
+
+enum {
+  resultModes(appendComma)
+  RLAST
+};
+
+extern char* resultModeNames[RLAST];
+
 typedef struct _Node {
   int type;
   int id; // unique
@@ -67,6 +81,15 @@ typedef struct _Result {
   char** prob;
   intmax_t* prime;
   char numCombosStr[8];
+
+  // RCUBE_MATRIX: average 1 in for each cube (rows) and tier (columns) that can roll the item
+  int* matrixCubes; // indices into cubeValues
+  int* matrixTiers; // indices into tierValues
+  char** matrix;
+
+  // RSWEEP: amount, 1 in and % chance of rolling at least that amount of the stat. 3 strings
+  // for every amount that can be rolled
+  char** sweep;
 } Result;
 
 typedef struct _TreeData {
@@ -107,6 +130,7 @@ void treeResultClear(Result* r);
 // when we calculate or when we change a connection
 
 char* nodeNames[nodeNamesCount] = { nodeTypes(StringifyComma) };
+char* resultModeNames[RLAST] = { resultModes(StringifyComma) };
 
 // TODO: avoid the extra pointers, this is not good for the cpu cache
 // ideally cache 1 page worth of lines into the struct for performance at draw time
@@ -121,14 +145,20 @@ void treeResultClear(Result* r) {
   BufFreeClear((void**)r->prob);
   BufFree(&r->prob);
   BufFree(&r->prime);
+  BufFree(&r->matrixCubes);
+  BufFree(&r->matrixTiers);
+  BufFreeClear((void**)r->matrix);
+  BufFree(&r->matrix);
+  BufFreeClear((void**)r->sweep);
+  BufFree(&r->sweep);
   MemZero(r);
   r->perPage = perPage;
 }
 
 // NSOME_NODE_NAME -> Some Node Name
-static void treeInitNodeNames() {
-  for (size_t i = 0; i < ArrayLength(nodeNames); ++i) {
-    char* p = nodeNames[i] = strdup(nodeNames[i]);
+static void treeInitNames(char** names, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    char* p = names[i] = strdup(names[i]);
     size_t len = strlen(p + 1);
     memmove(p, p + 1, len + 1);
     for (size_t j = 1; j < len; ++j) {
@@ -142,13 +172,17 @@ static void treeInitNodeNames() {
 }
 
 void treeGlobalInit() {
-  treeInitNodeNames();
+  treeInitNames(nodeNames, ArrayLength(nodeNames));
+  treeInitNames(resultModeNames, ArrayLength(resultModeNames));
 }
 
 void treeGlobalFree() {
   ArrayEach(char*, nodeNames, x) {
     free(*x);
   }
+  ArrayEach(char*, resultModeNames, x) {
+    free(*x);
+  }
 }
 
 void treeClear(TreeData* g) {
@@ -26,21 +26,27 @@ size_t treeCalcJobs();
 #include "utils.c"
 #include "cubecalc.c"
 
+#include <stdlib.h>
 #include <string.h>
 
 // TODO: remove this?
 #include <inttypes.h>
 extern void dbg(char* fmt, ...);
 
+// the ui only ever uses the generated data
+static CubeContext* treeCalcCtx;
+
 void treeCalcGlobalInit() {
   MTGlobalInit();
-  CubeGlobalInit();
+  treeCalcCtx = CubeContextNew(0);
+  CubeSetParallelFor(treeCalcCtx, MTParallelFor);
 }
 
 void treeCalcMTGlobalFree();
 void treeCalcGlobalFree() {
-  CubeGlobalFree();
   treeCalcMTGlobalFree();
+  CubeContextFree(treeCalcCtx);
+  treeCalcCtx = 0;
 }
 
 // we want to be able to override stats
@@ -257,15 +263,57 @@ char const* valueName(int type, int value) {
 void WantPrint(Want const* wantBuf);
 #endif
 
+// a result node and the wants it resolved to
+typedef struct _TreeCalcQuery {
+  int resultId;
+  Want* wants;
+  Result result;
+} TreeCalcQuery;
+
+// all the results that resolved to the same item. they are calculated together so
+// CubeCalcBatch can share the work between them. results in other modes get their own job
 typedef struct _TreeCalcJobData {
   size_t maxCombos;
-  char* treeData;
-  int resultId;
   intmax_t revision;
+  int mode;
+  Category category;
+  Cube cube;
+  Tier tier;
+  int level;
+  Region region;
+  TreeCalcQuery* queries;
+
+  // the task being stepped, see treeCalcStep
+  int started;
+  CubeCalcTask* task;
+
+  // probabilities of the wants that can be rolled, then the combos of each of them
+  Want const** batch;
+  intmax_t* batchIdx; // query index for each want in batch
+  float* p;
+  int listing;        // p is done and the combos of batch[next] are being listed
+  size_t next;
+  Combos combos;
+  size_t numCombos;
+
+  // result of the cube matrix and sweep modes
+  float* values;
 } TreeCalcJobData;
 
 void treeCalcJobDataFree(TreeCalcJobData* data) {
-  BufFree(&data->treeData);
+  BufEach(TreeCalcQuery, data->queries, q) {
+    BufFree(&q->wants);
+    treeResultClear(&q->result);
+  }
+  BufFree(&data->queries);
+  if (data->task) {
+    CubeCalcTaskFree(data->task);
+  }
+  BufFree(&data->batch);
+  BufFree(&data->batchIdx);
+  BufFree(&data->p);
+  CombosFree(&data->combos);
+  BufFree(&data->values);
   free(data);
 }
 
@@ -279,42 +327,25 @@ int resultById(TreeData* g, int id) {
   return -1;
 }
 
-void* treeCalcJob(void* data) {
-  TreeCalcJobData* jobData = data;
-  TreeData* g = malloc(sizeof(TreeData));
-  MemZero(g);
-
-  NodeData* d;
-  Node* n;
-  Want* wants = 0;
-
-  int values[NLAST];
+// walk the tree from a result node and build its wants. values receives the item settings
+// that apply to it, with defaults filled in. *pwants is left empty if there's nothing to calc
+static
+void treeCalcResolve(TreeData* g, int resultIdx, Want** pwants, int values[NLAST]) {
   int statMap[numLines];
   int* seen = 0;
   int elementsOnStack;
 
-  if (!unpackTree(g, jobData->treeData)) {
-    dbg("treeCalcJob: unexpected failure deserializing tree");
-    goto cleanup;
-  }
+  NodeData* d = &g->data[NRESULT][resultIdx];
 
-  int resultIdx = resultById(g, jobData->resultId);
-  if (resultIdx < 0) {
-    dbg("treeCalcJob: couldn't find result id %d", jobData->resultId);
-    goto cleanup;
-  }
-  d = &g->data[NRESULT][resultIdx];
-  n = &g->tree[d->node];
-
-  dbg("treeCalcJob %s\n", d->name);
+  dbg("treeCalcResolve %s\n", d->name);
 
-  ArrayEach(int, values, x) { *x = -1; }
+  RangeBefore(NLAST, i) { values[i] = -1; }
   ArrayEach(int, statMap, x) { *x = -1; }
 
   (void)BufReserve(&seen, BufLen(g->tree));
   BufZero(seen);
-  BufClear(wants);
-  elementsOnStack = treeCalcBranch(g, &wants, statMap, values, d->node, seen);
+  BufClear(*pwants);
+  elementsOnStack = treeCalcBranch(g, pwants, statMap, values, d->node, seen);
   BufFree(&seen);
 
   for (size_t j = NINVALID + 1; j < NLAST; ++j) {
@@ -344,93 +375,354 @@ void* treeCalcJob(void* data) {
 
   // complete any pending stats and push all the stats to the stack
   elementsOnStack += treeCalcFinalizeWants(statMap, values, 0);
-  treeCalcPushStats(&wants, statMap);
+  treeCalcPushStats(pwants, statMap);
 
-  if (BufLen(wants)) {
+  if (BufLen(*pwants)) {
     // terminate with an AND since we always want an operator
-    *BufAlloc(&wants) = WantOp(AND, elementsOnStack);
+    *BufAlloc(pwants) = WantOp(AND, elementsOnStack);
 
 #ifdef CUBECALC_DEBUG
     dbg("===========================================\n");
-    dbg("# %s\n", g->data[n->type][n->data].name);
-    WantPrint(wants);
+    dbg("# %s\n", d->name);
+    WantPrint(*pwants);
     dbg("===========================================\n");
 #endif
+  }
+}
 
-    Category category = categoryValues[values[NCATEGORY]];
-    Cube cube = cubeValues[values[NCUBE]];
-    Tier tier = tierValues[values[NTIER]];
-    Region region = regionValues[values[NREGION]];
-
-    Lines combos = {0};
-
-    float p = CubeCalc(wants, category, cube, tier, values[NLEVEL], region, &combos);
-    dbg("p: %f\n", p);
-    Result* resd = &g->resultData[n->data];
-    treeResultClear(resd);
-    if (p > 0) {
+static
+void treeCalcResult(Result* resd, float p, Combos const* combos, size_t numCombos) {
+  treeResultClear(resd);
+  if (p > 0) {
 
 #define fmt(x, y) Humanize(resd->x, sizeof(resd->x), y)
 #define quant(n, ...) fmt(within##n, ProbToGeoDistrQuantileDingle(p, n))
-      fmt(average, ProbToOneIn(p));
-      quant(50);
-      quant(75);
-      quant(95);
-      quant(99);
-
-      size_t numCombos = BufLen(combos.onein) / combos.comboSize;
-      fmt(numCombosStr, numCombos);
-
-      if (numCombos <= jobData->maxCombos) {
-        BufEachi(combos.onein, i) {
-          *BufAlloc(&resd->line) = LineToStr(combos.lineHi[i], combos.lineLo[i]);
-          BufAllocStrf(&resd->value, "%d", combos.value[i]);
-          BufAllocStrf(&resd->prob, "%.02f", 1/combos.onein[i]);
-        }
+    fmt(average, ProbToOneIn(p));
+    quant(50);
+    quant(75);
+    quant(95);
+    quant(99);
+
+    // the count is every match, but only the most likely combos are listed
+    fmt(numCombosStr, numCombos);
+
+    (void)BufReserveZero(&resd->prime, ArrayBitElements(resd->prime, BufLen(combos->index)));
+    BufEachi(combos->index, i) {
+      ComboLine const* line = CombosLine(combos, i);
+      *BufAlloc(&resd->line) = LineToStr(LineMaskHi(line->mask), LineMaskLo(line->mask));
+      BufAllocStrf(&resd->value, "%d", line->value);
+      if (!combos->groupProb) {
+        BufAllocStrf(&resd->prob, "%.02f", 1/CombosProb(combos, i));
+      } else if (i % combos->comboSize) {
+        BufAllocStrf(&resd->prob, "%s", "");
+      } else {
+        // grouped combos only have the probability of the whole group, on its first line
+        BufAllocStrf(&resd->prob, "%.02f", 1/combos->groupProb[i / combos->comboSize]);
+      }
+      if (line->prime) {
+        ArrayBitSet(resd->prime, i);
+      }
+    }
+    resd->comboLen = CombosNum(combos) ? combos->comboSize : 0;
+  }
+}
+
+// int compare for qsort on tierValues indices, lowest tier first
+static
+int treeCalcTierCmp(void const* a, void const* b) {
+  return tierValues[*(int const*)a] - tierValues[*(int const*)b];
+}
+
+static
+void treeCalcMatrixStart(TreeCalcJobData* jobData) {
+  TreeCalcQuery* q = &jobData->queries[0];
+  Cube* cubes = 0;
+  Tier* tiers = 0;
+  Region* regions = 0;
+  int* levels = 0;
+
+  ArrayEach(int const, cubeValues, x) { *BufAlloc(&cubes) = *x; }
+  ArrayEach(int const, tierValues, x) { *BufAlloc(&tiers) = *x; }
+  *BufAlloc(&regions) = jobData->region;
+  *BufAlloc(&levels) = jobData->level;
+
+  jobData->task = CubeCalcMatrixStart(treeCalcCtx, q->wants, jobData->category, cubes, tiers,
+    regions, levels, &jobData->values);
+
+  BufFree(&cubes);
+  BufFree(&tiers);
+  BufFree(&regions);
+  BufFree(&levels);
+}
+
+static
+void treeCalcMatrixResult(TreeCalcJobData* jobData) {
+  TreeCalcQuery* q = &jobData->queries[0];
+  Result* resd = &q->result;
+  float const* p = jobData->values;
+  int* tierIdx = 0;
+
+  treeResultClear(resd);
+  if (!p) {
+    return;
+  }
+
+  // only keep the cubes and tiers that can roll the item. tiers are sorted from lowest
+  size_t numTiers = ArrayLength(tierValues);
+  RangeBefore(numTiers, j) {
+    *BufAlloc(&tierIdx) = j;
+  }
+  qsort(tierIdx, numTiers, sizeof(tierIdx[0]), treeCalcTierCmp);
+  BufEach(int, tierIdx, j) {
+    ArrayEachi(cubeValues, i) {
+      if (p[i * numTiers + *j] >= 0) {
+        *BufAlloc(&resd->matrixTiers) = *j;
+        break;
+      }
+    }
+  }
+  ArrayEachi(cubeValues, i) {
+    BufEach(int, resd->matrixTiers, j) {
+      if (p[i * numTiers + *j] >= 0) {
+        *BufAlloc(&resd->matrixCubes) = i;
+        break;
+      }
+    }
+  }
+
+  BufEach(int, resd->matrixCubes, i) {
+    BufEach(int, resd->matrixTiers, j) {
+      float x = p[*i * numTiers + *j];
+      char buf[sizeof(resd->average)];
+      if (x > 0) {
+        Humanize(buf, sizeof(buf), ProbToOneIn(x));
+      } else {
+        snprintf(buf, sizeof(buf), "%s", x < 0 ? "-" : "never");
+      }
+      BufAllocStrf(&resd->matrix, "%s", buf);
+    }
+  }
+
+  BufFree(&tierIdx);
+}
 
-        (void)BufCpy(&resd->prime, combos.prime);
-        resd->comboLen = combos.comboSize;
+static
+void treeCalcSweepStart(TreeCalcJobData* jobData) {
+  TreeCalcQuery* q = &jobData->queries[0];
+
+  // the amounts in the branch don't matter, but it must be about a single stat
+  int lineHi = 0, lineLo = 0;
+  BufEach(Want, q->wants, w) {
+    if (w->type != WANT_STAT || (w->lineHi & LINES_HI) || (w->lineLo & LINES_LO)) {
+      continue;
+    }
+    if ((lineHi || lineLo) && (w->lineHi != lineHi || w->lineLo != lineLo)) {
+      dbg("treeCalcSweep: more than one stat, nothing to sweep\n");
+      return;
+    }
+    lineHi = w->lineHi;
+    lineLo = w->lineLo;
+  }
+  if (!lineHi && !lineLo) {
+    return;
+  }
+
+  jobData->task = CubeCalcSweepStart(treeCalcCtx, lineHi, lineLo, jobData->category,
+    jobData->cube, jobData->tier, jobData->level, jobData->region, &jobData->values);
+}
+
+static
+void treeCalcSweepResult(TreeCalcJobData* jobData) {
+  Result* resd = &jobData->queries[0].result;
+  float const* p = jobData->values;
+  treeResultClear(resd);
+
+  // only the amounts that can actually be rolled, the chance doesn't change in between
+  Range(1, (intmax_t)BufLen(p) - 1, v) {
+    if (p[v] <= 0 || (v + 1 < (intmax_t)BufLen(p) && p[v] == p[v + 1])) {
+      continue;
+    }
+    char buf[sizeof(resd->average)];
+    Humanize(buf, sizeof(buf), ProbToOneIn(p[v]));
+    BufAllocStrf(&resd->sweep, "%jd", v);
+    BufAllocStrf(&resd->sweep, "%s", buf);
+    BufAllocStrf(&resd->sweep, "%.3g%%", p[v] * 100);
+  }
+}
+
+// optimize the wants and start calculating their probabilities. the combos are listed once
+// that's done, see treeCalcCombosNext
+static
+void treeCalcCombosStart(TreeCalcJobData* jobData) {
+  BufEachi(jobData->queries, i) {
+    TreeCalcQuery* q = &jobData->queries[i];
+    if (!BufLen(q->wants)) {
+      continue;
+    }
+    Want* optimized = 0;
+    if (WantOptimize(treeCalcCtx, q->wants, jobData->category, jobData->cube, jobData->tier,
+          jobData->level, jobData->region, &optimized))
+    {
+#ifdef CUBECALC_DEBUG
+      dbg("# optimized\n");
+      WantPrint(optimized);
+#endif
+    }
+    BufFree(&q->wants);
+    q->wants = optimized;
+    // empty means there's no way to roll this, don't bother calculating
+    if (BufLen(q->wants)) {
+      *BufAlloc(&jobData->batch) = q->wants;
+      *BufAlloc(&jobData->batchIdx) = i;
+    }
+  }
+
+  // the probability comes from the fast engines, then only the combos that will be shown are
+  // generated, most likely first
+  (void)BufReserveZero(&jobData->p, BufLen(jobData->batch));
+  jobData->task = CubeCalcStart(treeCalcCtx, jobData->batch, BufLen(jobData->batch),
+    jobData->category, jobData->cube, jobData->tier, jobData->level, jobData->region,
+    jobData->p, 0);
+}
+
+// called when the task is done. stores the result of the combos that were being listed, if any,
+// and starts listing the combos of the next result that has any
+static
+void treeCalcCombosNext(TreeCalcJobData* jobData) {
+  float const* p = jobData->p;
+  if (jobData->listing) {
+    size_t j = jobData->next++;
+    treeCalcResult(&jobData->queries[jobData->batchIdx[j]].result, p[j], &jobData->combos,
+      jobData->numCombos);
+    CombosFree(&jobData->combos);
+    jobData->numCombos = 0;
+  }
+  jobData->listing = 1;
+
+  for (; jobData->next < BufLen(jobData->batch); ++jobData->next) {
+    size_t j = jobData->next;
+    dbg("p: %f\n", p[j]);
+    if (p[j] > 0 && jobData->maxCombos) {
+      if (jobData->mode == RGROUPED) {
+        jobData->task = CubeCalcGroupedStart(treeCalcCtx, jobData->batch[j], jobData->category,
+          jobData->cube, jobData->tier, jobData->level, jobData->region, jobData->maxCombos,
+          &jobData->combos, &jobData->numCombos);
+      } else {
+        jobData->task = CubeCalcTopStart(treeCalcCtx, jobData->batch[j], jobData->category,
+          jobData->cube, jobData->tier, jobData->level, jobData->region, jobData->maxCombos,
+          &jobData->combos, &jobData->numCombos);
       }
+      return;
     }
-    LinesFree(&combos);
+    treeCalcResult(&jobData->queries[jobData->batchIdx[j]].result, p[j], &jobData->combos, 0);
   }
 
-cleanup:
-  BufFree(&wants);
-  g->revision = jobData->revision;
-  treeCalcJobDataFree(jobData);
-  return g;
+  BufFree(&jobData->batch);
+  BufFree(&jobData->batchIdx);
+  BufFree(&jobData->p);
+}
+
+// runs for about budgetNs nanoseconds, see MTStartSteps. every mode is ran as CubeCalcTasks.
+// the matrix and the sweep are a single task. the combos modes calculate the probabilities of
+// all their results in one task, then list the combos of each result with another.
+// returns non-zero when done
+static
+int treeCalcStep(void* data, long budgetNs) {
+  TreeCalcJobData* jobData = data;
+  intmax_t deadline = CubeClockNs() + budgetNs;
+
+  if (!jobData->started) {
+    jobData->started = 1;
+    if (jobData->mode == RSWEEP) {
+      treeCalcSweepStart(jobData);
+    } else if (jobData->mode == RCUBE_MATRIX) {
+      if (BufLen(jobData->queries[0].wants)) {
+        treeCalcMatrixStart(jobData);
+      }
+    } else {
+      treeCalcCombosStart(jobData);
+    }
+  }
+
+  while (jobData->task) {
+    // what's left of the budget, the next task gets it
+    long left = 0;
+    if (budgetNs) {
+      left = Max(1, (long)(deadline - CubeClockNs()));
+    }
+    if (!CubeCalcStep(jobData->task, left)) {
+      return 0;
+    }
+    CubeCalcTaskFree(jobData->task);
+    jobData->task = 0;
+
+    if (jobData->mode == RSWEEP) {
+      treeCalcSweepResult(jobData);
+    } else if (jobData->mode == RCUBE_MATRIX) {
+      treeCalcMatrixResult(jobData);
+    } else {
+      treeCalcCombosNext(jobData);
+    }
+    if (budgetNs && CubeClockNs() >= deadline) {
+      break;
+    }
+  }
+  return !jobData->task;
 }
 
 static MTJob** jobs = 0;
-static int* resultIds = 0;
 
 void treeCalc(TreeData* g, size_t maxCombos) {
   ++g->revision;
 
-  // lazy but safe: just serialize the three and deserialize it to make a copy.
-  // this way we don't have to worry about making a proper deep copy of it and potentially
-  // duplicate a lot of the serialization logic.
-  Arena* arena = ArenaInit();
-  Allocator allocatorArena = ArenaAllocator(arena);
-  char* out = packTree(&allocatorArena, g);
-  if (!out) {
-    dbg("treeCalc: unexpected failure serializing tree");
-  } else {
-    BufEachi(g->resultData, i) {
-      Node* n = &g->tree[g->data[NRESULT][i].node];
-      TreeCalcJobData* data = malloc(sizeof(TreeCalcJobData));
+  // the wants are resolved here since it's cheap and it tells us which results share an item
+  TreeCalcJobData** groups = 0;
+  BufEachi(g->resultData, i) {
+    int values[NLAST];
+    Want* wants = 0;
+    treeCalcResolve(g, i, &wants, values);
+
+    Category category = categoryValues[values[NCATEGORY]];
+    Cube cube = cubeValues[values[NCUBE]];
+    Tier tier = tierValues[values[NTIER]];
+    Region region = regionValues[values[NREGION]];
+    int mode = g->data[NRESULT][i].value;
+
+    TreeCalcJobData* data = 0;
+    BufEach(TreeCalcJobData*, groups, pd) {
+      TreeCalcJobData* x = *pd;
+      if ((mode == RCOMBOS || mode == RGROUPED) && x->mode == mode && x->category == category &&
+          x->cube == cube && x->tier == tier && x->level == values[NLEVEL] &&
+          x->region == region)
+      {
+        data = x;
+        break;
+      }
+    }
+    if (!data) {
+      data = malloc(sizeof(TreeCalcJobData));
       MemZero(data);
       data->maxCombos = maxCombos;
-      data->treeData = BufDup(out);
-      data->resultId = n->id;
       data->revision = g->revision;
-      *BufAlloc(&jobs) = MTStart(treeCalcJob, data);
-      *BufAlloc(&resultIds) = n->id;
+      data->mode = mode;
+      data->category = category;
+      data->cube = cube;
+      data->tier = tier;
+      data->level = values[NLEVEL];
+      data->region = region;
+      *BufAlloc(&groups) = data;
     }
+
+    TreeCalcQuery* q = BufAlloc(&data->queries);
+    MemZero(q);
+    q->resultId = g->tree[g->data[NRESULT][i].node].id;
+    q->wants = wants;
   }
 
-  ArenaFree(arena);
+  BufEach(TreeCalcJobData*, groups, pd) {
+    *BufAlloc(&jobs) = MTStartSteps(treeCalcStep, *pd);
+  }
+  BufFree(&groups);
 }
 
 int treeCalcMerge(TreeData* g) {
@@ -439,33 +731,32 @@ int treeCalcMerge(TreeData* g) {
   BufEachi(jobs, i) {
     MTJob* j = jobs[i];
     if (MTDone(j)) {
-      TreeData* merge = MTResult(j);
+      TreeCalcJobData* merge = MTResult(j);
       dbg("joined %p\n", merge);
       dbg("revision %jd\n", merge->revision);
       // we keep track of whether the tree has changed since the calc was started.
       // this is done by incrementing revision every time treeCalc is called.
       // if it doesn't match with what it was when job was started, then we ignore the job result
       if (merge->revision == g->revision) {
-        int rdata = resultById(merge, resultIds[i]);
-        if (rdata < 0) {
-          dbg("treeCalcMerge: couldn't locate result id %d", resultIds[i]);
-        } else {
-          Result* r = &merge->resultData[rdata];
-          int drdata = resultById(g, resultIds[i]);
-          Result* dr = &g->resultData[drdata];
-          treeResultClear(dr);
-          *dr = *r;
-          MemZero(r); // to make sure it doesn't get freed twice
-          res = 1;
+        BufEach(TreeCalcQuery, merge->queries, q) {
+          int drdata = resultById(g, q->resultId);
+          if (drdata < 0) {
+            dbg("treeCalcMerge: couldn't locate result id %d", q->resultId);
+          } else {
+            Result* dr = &g->resultData[drdata];
+            treeResultClear(dr);
+            q->result.perPage = dr->perPage;
+            *dr = q->result;
+            MemZero(&q->result); // to make sure it doesn't get freed twice
+            res = 1;
+          }
         }
       } else {
         // I don't think this can happen now that I only allow starting new calcs when there's
         // no background jobs, but might as well check for good measure
         dbg("(discarded, current revision is %jd)\n", g->revision);
       }
-      treeClear(merge);
-      treeFree(merge);
-      free(merge);
+      treeCalcJobDataFree(merge);
       MTFree(j);
       dbg("%zu done\n", i);
     } else {
@@ -474,13 +765,9 @@ int treeCalcMerge(TreeData* g) {
   }
 
   MTJob** newJobs = 0;
-  int* newResultIds = 0;
   BufIndex(jobs, keep, &newJobs);
-  BufIndex(resultIds, keep, &newResultIds);
   BufFree(&jobs);
-  BufFree(&resultIds);
   jobs = newJobs;
-  resultIds = newResultIds;
   BufFree(&keep);
 
   return res;
@@ -489,13 +776,14 @@ int treeCalcMerge(TreeData* g) {
 void treeCalcMTGlobalFree() {
   BufEach(MTJob*, jobs, pj) {
     size_t n = 0;
+    MTRunSteps(0);
     while (!MTDone(*pj)) {
       MTYield(&n);
     }
+    treeCalcJobDataFree(MTResult(*pj));
     MTFree(*pj);
   }
   BufFree(&jobs);
-  BufFree(&resultIds);
   MTGlobalFree();
 }
 
@@ -111,6 +111,10 @@ struct nk_vec2 savedMousePos; // in node space, not screen space
 int tool;
 int disclaimerHeight = 290;
 int maxCombos = 300;
+
+// how long calculations get to run on the main thread every frame in single threaded builds,
+// about half of a frame at 60fps
+#define CALC_BUDGET_NS 8000000
 #ifndef __EMSCRIPTEN__
 int fpsTarget = 60;
 #endif
@@ -736,6 +740,53 @@ void loop() {
   nk_label(nk, *graph.resultData[i].x ? graph.resultData[i].x : "impossible", NK_TEXT_LEFT)
 #define q(n) l(#n "% within:", within##n)
 
+        NodeData* d = &graph.data[NRESULT][i];
+        Result* r = &graph.resultData[i];
+
+        nk_layout_row_dynamic(nk, 20, 1);
+        int newMode = nk_combo(nk, (const char**)resultModeNames, RLAST, d->value, 20,
+          nk_vec2(nk_widget_width(nk), 100));
+        uiTreeSetValue(d, newMode);
+
+        if (d->value == RCUBE_MATRIX) {
+          // average 1 in, one row per cube and one column per tier
+          int cols = BufLen(r->matrixTiers);
+          if (!cols) {
+            nk_layout_row_dynamic(nk, 10, 1);
+            nk_label(nk, "impossible", NK_TEXT_LEFT);
+            goto terminateNode;
+          }
+          nk_layout_row_dynamic(nk, 10, cols + 1);
+          nk_spacer(nk);
+          BufEach(int, r->matrixTiers, j) {
+            nk_label(nk, tierNames[*j], NK_TEXT_RIGHT);
+          }
+          BufEachi(r->matrixCubes, row) {
+            nk_label(nk, cubeNames[r->matrixCubes[row]], NK_TEXT_LEFT);
+            RangeBefore(cols, col) {
+              nk_label(nk, r->matrix[row * cols + col], NK_TEXT_RIGHT);
+            }
+          }
+          goto terminateNode;
+        }
+
+        if (d->value == RSWEEP) {
+          // chance of rolling at least each amount of the stat
+          if (!BufLen(r->sweep)) {
+            nk_layout_row_dynamic(nk, 10, 1);
+            nk_label(nk, "impossible", NK_TEXT_LEFT);
+            goto terminateNode;
+          }
+          nk_layout_row_dynamic(nk, 10, 3);
+          nk_label(nk, "amount", NK_TEXT_RIGHT);
+          nk_label(nk, "1 in", NK_TEXT_RIGHT);
+          nk_label(nk, "chance", NK_TEXT_RIGHT);
+          BufEach(char*, r->sweep, x) {
+            nk_label(nk, *x, NK_TEXT_RIGHT);
+          }
+          goto terminateNode;
+        }
+
         nk_layout_row_template_begin(nk, 10);
         nk_layout_row_template_push_static(nk, 90);
         nk_layout_row_template_push_dynamic(nk);
@@ -744,7 +795,6 @@ void loop() {
         q(50); q(75); q(95); q(99);
         l("combos:", numCombosStr);
 
-        Result* r = &graph.resultData[i];
         if (!r->comboLen) goto terminateNode;
 
         nk_layout_row_dynamic(nk, 10, 1);
@@ -965,6 +1015,7 @@ terminateNode:
     flags &= ~DIRTY;
   }
 
+  MTRunSteps(CALC_BUDGET_NS);
   if (treeCalcMerge(&graph)) {
     dbg("merged");
   }
@@ -16,6 +16,24 @@ MTJob* MTStart(MTJobFunc* func, void* data);
 
 int MTDone(MTJob* j); // check if job is done. does not block. can be called concurrently
 
+// queue a job that calls func(data, budgetNs) until it returns non-zero. MTResult returns data.
+// func should return after working for about budgetNs nanoseconds, or run until done if
+// budgetNs is 0. with threads this runs on a worker with no budget. with NO_MULTITHREAD it
+// only runs when MTRunSteps is called, so long jobs can be spread over several frames
+typedef int MTStepFunc(void* data, long budgetNs);
+MTJob* MTStartSteps(MTStepFunc* func, void* data);
+
+// give the jobs from MTStartSteps about budgetNs nanoseconds in total to run, or run them until
+// done if budgetNs is 0. does nothing unless NO_MULTITHREAD is defined
+void MTRunSteps(long budgetNs);
+
+// call func(data, i) for every i in [0, n) on the worker threads and wait for all of them to
+// complete. unlike MTStart, this can be called from any thread including from inside a job.
+// the calling thread also runs iterations while it waits so this never deadlocks even when
+// all workers are busy
+typedef void MTForFunc(void* data, size_t i);
+void MTParallelFor(MTForFunc* func, void* data, size_t n);
+
 // !! NOTE: these funcs are only valid if MTDone returns non-zero!!!
 void* MTResult(MTJob* j); // returns what func from MTStart returned
 void MTFree(MTJob* j);
@@ -95,12 +113,22 @@ void MTYield(size_t* n) {
 }
 
 #ifdef NO_MULTITHREAD
+#include "utils.c"
+
+struct _MTJob {
+  MTStepFunc* step; // cleared when the job is done
+  void* data;       // result when the job is done
+};
+
+// jobs from MTStartSteps that are not done yet, in the order they were started
+static MTJob** mtSteps;
+
 void MTGlobalInit() {
 
 }
 
 void MTGlobalFree() {
-
+  BufFree(&mtSteps);
 }
 
 size_t MTNumThreads() {
@@ -108,19 +136,59 @@ size_t MTNumThreads() {
 }
 
 MTJob* MTStart(MTJobFunc* func, void* data) {
-  return (MTJob*)func(data);
+  MTJob* j = malloc(sizeof(MTJob));
+  j->step = 0;
+  j->data = func(data);
+  return j;
+}
+
+MTJob* MTStartSteps(MTStepFunc* func, void* data) {
+  MTJob* j = malloc(sizeof(MTJob));
+  j->step = func;
+  j->data = data;
+  *BufAlloc(&mtSteps) = j;
+  return j;
+}
+
+// the budget is split evenly between the jobs so one long job doesn't hold back the others
+void MTRunSteps(long budgetNs) {
+  size_t n = BufLen(mtSteps);
+  if (!n) {
+    return;
+  }
+  long share = budgetNs ? Max(1, budgetNs / (long)n) : 0;
+  intmax_t* keep = 0;
+  BufEachi(mtSteps, i) {
+    MTJob* j = mtSteps[i];
+    if (j->step(j->data, share)) {
+      j->step = 0;
+    } else {
+      *BufAlloc(&keep) = i;
+    }
+  }
+  MTJob** newSteps = 0;
+  BufIndex(mtSteps, keep, &newSteps);
+  BufFree(&mtSteps);
+  mtSteps = newSteps;
+  BufFree(&keep);
 }
 
 int MTDone(MTJob* j) {
-  return 1;
+  return !j->step;
 }
 
 void* MTResult(MTJob* j) {
-  return j;
+  return j->data;
 }
 
 void MTFree(MTJob* j) {
+  free(j);
+}
 
+void MTParallelFor(MTForFunc* func, void* data, size_t n) {
+  RangeBefore(n, i) {
+    func(data, i);
+  }
 }
 
 #else
@@ -197,6 +265,7 @@ typedef struct _MTJob {
   void* data;
   void* result;
   int terminate;
+  int detached; // nobody is waiting on the result, free the job when it's done
   atomic_int done;
   struct _MTJob* next; // used in the many consumers queue
 } MTJob;
@@ -231,31 +300,35 @@ static intmax_t workerId() {
 
 static
 void* MTWorker(void* ptr) {
-  int terminate = 0;
   pthread_mutex_lock(&workerMutex);
-  while (!terminate) {
+  while (1) {
     mtdbg("waiting for work");
-    // this unlocks workerMutex and goes to sleep until signaled. relocks once signaled
-    // not signaled unless there's any work. this way we don't spam this loop
-    pthread_cond_wait(&workerCond, &workerMutex);
+    // this unlocks workerMutex and goes to sleep until signaled. relocks once signaled.
+    // work might have been queued while we were busy, in which case we missed the signal,
+    // so only wait if the queue is empty
+    while (!mtQueue) {
+      pthread_cond_wait(&workerCond, &workerMutex);
+    }
     MTJob* j = mtQueue;
-    if (j) {
-      if (!j->terminate) {
-        mtQueue = mtQueue->next;
-      } else {
-        // make sure all other workers wake up to the termination job
-        pthread_cond_broadcast(&workerCond);
-      }
+    if (j->terminate) {
+      // make sure all other workers wake up to the termination job
+      pthread_cond_broadcast(&workerCond);
+      atomic_fetch_add(&j->done, 1);
+      break;
     }
-    if (j) {
-      mtdbg("working on %p", j);
-      terminate |= j->terminate;
-      if (!j->terminate) {
-        j->result = j->func ? j->func(j->data) : 0;
-      }
-      mtdbg("work complete");
+    mtQueue = mtQueue->next;
+
+    // don't hold the lock while working so other workers can pick up jobs
+    pthread_mutex_unlock(&workerMutex);
+    mtdbg("working on %p", j);
+    j->result = j->func ? j->func(j->data) : 0;
+    mtdbg("work complete");
+    if (j->detached) {
+      free(j);
+    } else {
       atomic_fetch_add(&j->done, 1);
     }
+    pthread_mutex_lock(&workerMutex);
   }
   mtdbg("terminating worker");
   pthread_mutex_unlock(&workerMutex);
@@ -336,6 +409,31 @@ MTJob* MTStart(MTJobFunc* func, void* data) {
   return _MTStart(0, func, data);
 }
 
+typedef struct _MTSteps {
+  MTStepFunc* func;
+  void* data;
+} MTSteps;
+
+static
+void* MTStepsJob(void* data) {
+  MTSteps* s = data;
+  void* res = s->data;
+  while (!s->func(res, 0));
+  free(s);
+  return res;
+}
+
+MTJob* MTStartSteps(MTStepFunc* func, void* data) {
+  MTSteps* s = malloc(sizeof(MTSteps));
+  s->func = func;
+  s->data = data;
+  return MTStart(MTStepsJob, s);
+}
+
+void MTRunSteps(long budgetNs) {
+  (void)budgetNs;
+}
+
 int MTDone(MTJob* j) {
   return atomic_load(&j->done);
 }
@@ -348,6 +446,85 @@ void MTFree(MTJob* j) {
   free(j);
 }
 
+// shared by the caller of MTParallelFor and the helper jobs. whoever is done with it last
+// frees it, the caller doesn't wait for helpers that didn't get to run before all the
+// iterations were taken
+typedef struct _MTFor {
+  MTForFunc* func;
+  void* data;
+  size_t n;
+  atomic_size_t next; // next iteration to take
+  atomic_size_t done; // number of completed iterations
+  atomic_int refs;
+} MTFor;
+
+static
+void MTForRun(MTFor* f) {
+  size_t i;
+  while ((i = atomic_fetch_add(&f->next, 1)) < f->n) {
+    f->func(f->data, i);
+    atomic_fetch_add(&f->done, 1);
+  }
+}
+
+static
+void MTForRelease(MTFor* f) {
+  if (atomic_fetch_sub(&f->refs, 1) == 1) {
+    free(f);
+  }
+}
+
+static
+void* MTForJob(void* data) {
+  MTForRun(data);
+  MTForRelease(data);
+  return 0;
+}
+
+void MTParallelFor(MTForFunc* func, void* data, size_t n) {
+  size_t helpers = Min(n ? n - 1 : 0, BufLen(workers));
+  MTFor* f = helpers ? malloc(sizeof(MTFor)) : 0;
+  if (!f) {
+    RangeBefore(n, i) {
+      func(data, i);
+    }
+    return;
+  }
+
+  f->func = func;
+  f->data = data;
+  f->n = n;
+  atomic_init(&f->next, 0);
+  atomic_init(&f->done, 0);
+  atomic_init(&f->refs, 1);
+
+  // MTStart is single producer so push the helpers straight to the locked queue instead
+  pthread_mutex_lock(&workerMutex);
+  RangeBefore(helpers, i) {
+    MTJob* j = malloc(sizeof(MTJob));
+    if (!j) {
+      perror("malloc");
+      break;
+    }
+    MemZero(j);
+    j->func = MTForJob;
+    j->data = f;
+    j->detached = 1;
+    atomic_fetch_add(&f->refs, 1);
+    j->next = mtQueue;
+    mtQueue = j;
+  }
+  pthread_cond_broadcast(&workerCond);
+  pthread_mutex_unlock(&workerMutex);
+
+  MTForRun(f);
+  size_t k = 0;
+  while (atomic_load(&f->done) < n) {
+    MTYield(&k);
+  }
+  MTForRelease(f);
+}
+
 void MTGlobalInit() {
 #ifdef MICROSHAFT_WANGBLOWS
   // TODO: move all this stuff to some kind of OS layer
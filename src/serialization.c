@@ -120,6 +120,7 @@ char* packTree(Allocator const* allocator, TreeData* g) {
       case NRESULT: {
         Result* r = &g->resultData[n->data];
         SavedResult* sr = &savedResultData[n->data];
+        sd->valuelo = d->value; // result mode
         saved_result__init(sr);
         sr->page = r->page;
         sr->perpage = r->perPage;
@@ -333,6 +334,11 @@ int unpackTree(TreeData* g, char* rawData) {
           Result* r = &g->resultData[n->data];
           r->page = sr->page;
           r->perPage = sr->perpage;
+          if (sd->valuelo < 0 || sd->valuelo >= RLAST) {
+            fprintf(stderr, "node id %d has invalid result mode %d\n", n->id, sd->valuelo);
+            goto cleanup;
+          }
+          d->value = sd->valuelo;
           break;
         }
       }
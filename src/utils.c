@@ -508,6 +508,46 @@ int MapSet(Map* m, int key, void* value);
 #define MapKeys(m) _MapKeys(m, &allocatorDefault)
 int* _MapKeys(Map* m, Allocator const* allocator);
 
+//
+// HashIndex
+//
+// open addressing index from 64-bit hashes to non-zero values, usually pointers or indices + 1
+// into an array owned by the caller. the caller stores the keys and compares them, the index only
+// finds the values that have the same hash. lookups stop at the first empty slot and deleted
+// values leave a tombstone until the next resize, so a miss costs about the same as a hit.
+// a zeroed HashIndex is empty and ready to use
+//
+// example usage:
+//
+//   size_t cursor = 0;
+//   for (uintptr_t v; (v = HashIndexNext(&index, hash, &cursor));) {
+//     Thing* t = (Thing*)v;
+//     if (ThingEq(t, key)) return t;
+//   }
+//
+
+typedef struct _HashIndex {
+  size_t cap, len, dead; // dead is the number of tombstones
+  uint64_t* hashes;
+  uintptr_t* values;
+} HashIndex;
+
+void HashIndexFree(HashIndex* h);
+
+// remove every value but keep the memory
+void HashIndexClear(HashIndex* h);
+
+// returns the next value with this hash after *cursor and advances it, 0 when there's no more.
+// *cursor must be 0 on the first call. it's the number of slots looked at so far, not counting
+// the empty slot that ends the lookup
+uintptr_t HashIndexNext(HashIndex const* h, uint64_t hash, size_t* cursor);
+
+// add a value without checking if it's already there. returns 0 if out of memory
+int HashIndexAdd(HashIndex* h, uint64_t hash, uintptr_t value);
+
+// delete a value that was added with this hash
+void HashIndexDel(HashIndex* h, uint64_t hash, uintptr_t value);
+
 //
 // Math
 //
@@ -524,6 +564,10 @@ size_t BitCount(void* data, size_t bytes);
 // hash functions
 unsigned HashInt(unsigned x);
 
+// 64-bit FNV-1a. pass HASH_SEED as h to start a new hash or a previous result to chain them
+#define HASH_SEED 0xcbf29ce484222325ull
+uint64_t HashBytes(void const* data, size_t size, uint64_t h);
+
 //
 // Align: right justifies a group of lines
 //
@@ -1165,6 +1209,101 @@ void MapDel(Map* m, int key) {
 }
 
 
+//
+// HashIndex
+//
+
+#define HASH_INDEX_DEAD ((uintptr_t)-1)
+#define HASH_INDEX_BASE_CAP 16
+
+void HashIndexFree(HashIndex* h) {
+  free(h->hashes);
+  free(h->values);
+  memset(h, 0, sizeof(*h));
+}
+
+void HashIndexClear(HashIndex* h) {
+  if (h->cap) {
+    memset(h->values, 0, h->cap * sizeof(h->values[0]));
+  }
+  h->len = h->dead = 0;
+}
+
+// fibonacci hashing, so weak low bits in the hash still spread over the whole table
+static size_t HashIndexStart(HashIndex const* h, uint64_t hash) {
+  return (size_t)((hash * 0x9e3779b97f4a7c15ull) >> 32) & (h->cap - 1);
+}
+
+uintptr_t HashIndexNext(HashIndex const* h, uint64_t hash, size_t* cursor) {
+  size_t start = h->cap ? HashIndexStart(h, hash) : 0;
+  for (; *cursor < h->cap; ++*cursor) {
+    size_t i = (start + *cursor) & (h->cap - 1);
+    uintptr_t v = h->values[i];
+    if (!v) {
+      // stay on the empty slot so the next call stops here too
+      return 0;
+    }
+    if (v != HASH_INDEX_DEAD && h->hashes[i] == hash) {
+      ++*cursor;
+      return v;
+    }
+  }
+  return 0;
+}
+
+static void HashIndexPut(HashIndex* h, uint64_t hash, uintptr_t value) {
+  for (size_t i = HashIndexStart(h, hash); ; i = (i + 1) & (h->cap - 1)) {
+    if (!h->values[i] || h->values[i] == HASH_INDEX_DEAD) {
+      h->dead -= h->values[i] == HASH_INDEX_DEAD;
+      h->hashes[i] = hash;
+      h->values[i] = value;
+      ++h->len;
+      return;
+    }
+  }
+}
+
+int HashIndexAdd(HashIndex* h, uint64_t hash, uintptr_t value) {
+  if ((h->len + h->dead + 1) * 2 > h->cap) {
+    // grow or just drop the tombstones, keeping the table at most half full
+    HashIndex n = { .cap = Max(HASH_INDEX_BASE_CAP, RoundUp2((h->len + 1) * 4)) };
+    n.hashes = malloc(n.cap * sizeof(n.hashes[0]));
+    n.values = calloc(n.cap, sizeof(n.values[0]));
+    if (!n.hashes || !n.values) {
+      HashIndexFree(&n);
+      return 0;
+    }
+    RangeBefore(h->cap, i) {
+      if (h->values[i] && h->values[i] != HASH_INDEX_DEAD) {
+        HashIndexPut(&n, h->hashes[i], h->values[i]);
+      }
+    }
+    HashIndexFree(h);
+    *h = n;
+  }
+  HashIndexPut(h, hash, value);
+  return 1;
+}
+
+void HashIndexDel(HashIndex* h, uint64_t hash, uintptr_t value) {
+  if (!h->cap) {
+    return;
+  }
+  size_t i = HashIndexStart(h, hash);
+  RangeBefore(h->cap, j) {
+    if (!h->values[i]) {
+      break;
+    }
+    if (h->values[i] == value && h->hashes[i] == hash) {
+      h->values[i] = HASH_INDEX_DEAD;
+      --h->len;
+      ++h->dead;
+      return;
+    }
+    i = (i + 1) & (h->cap - 1);
+  }
+}
+
 //
 // Math
 //
@@ -1218,6 +1357,15 @@ unsigned HashInt(unsigned x) {
   return x;
 }
 
+uint64_t HashBytes(void const* data, size_t size, uint64_t h) {
+  unsigned char const* p = data;
+  RangeBefore(size, i) {
+    h ^= p[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
 //
 // Align
 //